@@ -25,7 +25,6 @@ bool exit_requested = false;
 unsigned char target_color[3] = {0};
 pthread_mutex_t exit_req_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t target_color_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t keyboard_lock = PTHREAD_MUTEX_INITIALIZER;
 Display* display;
 Window root;
 XWindowAttributes gwa;
@@ -205,11 +204,9 @@ void* update_keyboard_color(void* ptr) {
         if (equal)
             continue;
     
-        pthread_mutex_lock(&keyboard_lock);
         int r = libmk_set_full_color(NULL, color[0], color[1], color[2]);
         if (r != LIBMK_SUCCESS)
             printf("LibMK Error: %d\n", r);
-        pthread_mutex_unlock(&keyboard_lock);
         
         struct timespec time;
         time.tv_nsec = 100000000 / 4;
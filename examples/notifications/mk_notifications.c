@@ -28,7 +28,7 @@ double flash_time = 1.0;
 /// Mutexes
 pthread_mutex_t exit_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t target_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t keyboard_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t flash_lock = PTHREAD_MUTEX_INITIALIZER; // Pauses capture while flashing
 
 /// Threads
 pthread_t keyboard_thread;
@@ -119,7 +119,7 @@ static PyObject* init(PyObject* self, PyObject* args) {
     
     capture_args = init_capture(divider, sat_bias, lower, upper,
         brightness_norm != 0, &target_color, &target_lock, &exit_requested,
-        &exit_lock, &keyboard_lock);
+        &exit_lock, &flash_lock);
     
     if (args == NULL) {
         PyErr_SetString(PyExc_RuntimeError, "Failed to build CaptureArgs struct");
@@ -253,10 +253,10 @@ void __flash_keyboard(unsigned char* color) {
 
 
 void _flash_keyboard(unsigned char* color) {
-    pthread_mutex_lock(&keyboard_lock);
+    pthread_mutex_lock(&flash_lock);
     for (int i=0; i<flash_repeat; i++)
         __flash_keyboard(color);
-    pthread_mutex_unlock(&keyboard_lock);
+    pthread_mutex_unlock(&flash_lock);
     free(color);
 }
 
@@ -2,13 +2,20 @@
  * License: GNU GPLv3
  * Copyright (c) 2018-2019 RedFantom
 */
+#define _POSIX_C_SOURCE 200809L  // posix_memalign
 #include "libmk.h"
 #include "libusb.h"
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 // #define LIBMK_DEBUG
 // #define LIBMK_USB_DEBUG
@@ -32,8 +39,44 @@
  * different language (like Python), interaction is easier.
 */
 static libusb_context* Context;
+static LibMK_Descriptor* Descriptors = NULL;
+static pthread_mutex_t DescriptorsLock = PTHREAD_MUTEX_INITIALIZER;
+static char* CacheFile = NULL;
+static LibMK_KeyMap* KeyMaps = NULL;
+static pthread_mutex_t KeyMapsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t KeyMapsOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t DeviceRefsLock = PTHREAD_MUTEX_INITIALIZER;
 static LibMK_Handle* DeviceHandle;
 
+/** libusb event thread
+ *
+ * Handles the libusb events of the library context in the background
+ * while any handle uses LIBMK_ACK_DEFERRED.
+*/
+static pthread_t EventThread;
+static pthread_mutex_t EventThreadLock = PTHREAD_MUTEX_INITIALIZER;
+static int EventThreadUsers = 0;
+static pthread_mutex_t EventExitLock = PTHREAD_MUTEX_INITIALIZER;
+static bool EventThreadExit = false;
+
+/** Device registry
+ *
+ * Set of the supported devices attached to the machine, maintained by
+ * a thread from the hotplug events of libusb while it is running.
+*/
+static pthread_t RegistryThread;
+static pthread_mutex_t RegistryLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t RegistryCond = PTHREAD_COND_INITIALIZER;
+static bool RegistryRunning = false;
+static bool RegistryExit = false;
+static libusb_hotplug_callback_handle RegistryHotplug;
+static LibMK_HotplugEvent* RegistryEvents = NULL;
+static LibMK_HotplugEvent* RegistryPending = NULL;
+static LibMK_Device* RegistryDevices = NULL;
+static int RegistrySize = 0;
+static LibMK_DeviceCallback RegistryCallback = NULL;
+static void* RegistryData = NULL;
+
 typedef enum LibMK_Model LibMK_Model;
 typedef enum LibMK_Result LibMK_Result;
 typedef enum LibMK_Effect LibMK_Effect;
@@ -48,14 +91,29 @@ const unsigned char HEADER_ERROR = 0xFF;          // 1111 1111
 const unsigned char OPCODE_EFFECT = 0x28;         // 0010 1000
 const unsigned char OPCODE_ALL_LED = 0xA8;        // 1010 1000
 const unsigned char OPCODE_EFFECT_ARGS = 0x2c;    // 0010 1100
+const unsigned char HEADER_CONTROL = 0x41;        // 0100 0001
+const unsigned char OPCODE_SINGLE_LED = 0x01;     // 0000 0001
 
 const unsigned int ANSI[] =
     {0x003b, 0x0000};
 const unsigned int ISO[] =
     {0x0047, 0x0000};
 
-const unsigned char LAYOUT_ANSI = 0;
-const unsigned char LAYOUT_ISO = 1;
+const LibMK_Transport LIBMK_USB_TRANSPORT = {
+    libmk_run_pipeline,
+    libmk_usb_claim_interface,
+    libmk_usb_release_interface,
+    libmk_usb_reset,
+    libmk_usb_close
+};
+
+const LibMK_Transport LIBMK_SIM_TRANSPORT = {
+    libmk_sim_send_packets,
+    libmk_sim_claim_interface,
+    libmk_sim_release_interface,
+    libmk_sim_reset,
+    libmk_sim_close
+};
 
 const char* LIBMK_MODEL_STRINGS[] = {
     "MasterKeys Pro L RGB",
@@ -68,116 +126,142 @@ const char* LIBMK_MODEL_STRINGS[] = {
     "MasterKeys Pro S White",
 };
 
-/** Layout matrices
+/** Layout maps
  *
- * These matrices describe the internal addresses of keys within the
- * keyboard. The matrix is in [row][column] format. A value of 0xFF
- * indicates an unknown value.
+ * These maps list the internal addresses (offsets) of the keys within
+ * the keyboard as {row, col, offset, reserved}. Only the keys present
+ * on the keyboard are listed. Maps of further keyboards may be loaded at
+ * runtime with libmk_load_layouts.
 */
-const unsigned char LIBMK_LAYOUT[2][3][LIBMK_MAX_ROWS][LIBMK_MAX_COLS] = {
-    { // ANSI Layouts
-        // Layout size L
-        {{0x0b, 0x16, 0x1e, 0x19, 0x1b, 0xff, 0x07, 0x33, 0x39, 0x3e, 0xff, 0x56,
-          0x57, 0x53, 0x55, 0x4f, 0x48, 0x00, 0x65, 0x6d, 0x75, 0x77, 0xff, 0xff},
-         {0x0e, 0x0f, 0x17, 0x1f, 0x27, 0x26, 0x2e, 0x2f, 0x37, 0x3f, 0x47, 0x46,
-          0x36, 0xff, 0x51, 0x03, 0x01, 0x02, 0x64, 0x6c, 0x74, 0x76, 0xff, 0xff},
-         {0x09, 0x08, 0x10, 0x18, 0x20, 0x21, 0x29, 0x28, 0x30, 0x38, 0x40, 0x41,
-          0x31, 0xff, 0x52, 0x5e, 0x5c, 0x58, 0x60, 0x68, 0x70, 0x6e, 0xff, 0xff},
-         {0x11, 0x0a, 0x12, 0x1a, 0x22, 0x23, 0x2b, 0x2a, 0x32, 0x3a, 0x42, 0x43,
-          0xff, 0xff, 0x54, 0xff, 0xff, 0xff, 0x61, 0x69, 0x71, 0xff, 0xff, 0xff},
-         {0x49, 0xff, 0x0c, 0x14, 0x1c, 0x24, 0x25, 0x2d, 0x2c, 0x34, 0x3c, 0x45,
-          0xff, 0xff, 0x4a, 0xff, 0x50, 0xff, 0x62, 0x6a, 0x72, 0x6f, 0xff, 0xff},
-         {0x06, 0x5a, 0x4b, 0xff, 0xff, 0xff, 0x5b, 0xff, 0xff, 0xff, 0x4d, 0x4e,
-          0x3d, 0xff, 0x04, 0x5f, 0x5d, 0x05, 0x6b, 0xff, 0x73, 0xff, 0xff, 0xff},
-         {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-          0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}},
-        // Layout size M
-        // TODO: Find the key layout matrix of an ANSI M keyboard
-        {{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}},
-        // Layout size S
-        {{0x60, 0x61, 0x62, 0x63, 0x68, 0xFF, 0x69, 0x6A, 0x70, 0x71, 0xFF, 0x72,
-          0x43, 0x44, 0x45, 0x66, 0x67, 0x6B, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0x00, 0x01, 0x08, 0x09, 0x10, 0x11, 0x18, 0x19, 0x20, 0x21, 0x28, 0x29,
-          0x30, 0xFF, 0x31, 0x38, 0x39, 0x40, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0x02, 0x03, 0x0A, 0x0B, 0x12, 0x13, 0x1A, 0x1B, 0x22, 0x23, 0x2A, 0x2B,
-          0x32, 0xFF, 0x33, 0x3A, 0x3B, 0x42, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0x04, 0x05, 0x0C, 0x0D, 0x14, 0x15, 0x1C, 0x1D, 0x24, 0x25, 0x2C, 0x2D,
-          0xFF, 0xFF, 0x34, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0x06, 0xFF, 0x07, 0x0E, 0x0F, 0x16, 0x17, 0x1E, 0x1F, 0x26, 0x27, 0x2E,
-          0x01, 0xFF, 0x2F, 0xFF, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0x5B, 0x5A, 0x5C, 0xFF, 0xFF, 0xFF, 0x5D, 0xFF, 0xFF, 0xFF, 0x5E, 0x3C,
-          0x5F, 0xFF, 0x36, 0x3F, 0x3E, 0x46, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}},
-    }, { // ISO Layouts
-        // Layout size L
-        // This key layout matrix was copied from libcmmk, GNU GPLv3
-        {{0x0B, 0x16, 0x1E, 0x19, 0x1B, 0xFF, 0x07, 0x33, 0x39, 0x3E, 0xFF, 0x56,
-          0x57, 0x53, 0x55, 0x4F, 0x48, 0x00, 0x65, 0x6D, 0x75, 0x77, 0xFF, 0xFF},
-         {0x0E, 0x0F, 0x17, 0x1F, 0x27, 0x26, 0x2E, 0x2F, 0x37, 0x3F, 0x47, 0x46,
-          0x36, 0xFF, 0x51, 0x03, 0x01, 0x02, 0x64, 0x6C, 0x74, 0x76, 0xFF, 0xFF},
-         {0x09, 0x08, 0x10, 0x18, 0x20, 0x21, 0x29, 0x28, 0x30, 0x38, 0x40, 0x41,
-          0x31, 0xFF, 0x54, 0x5E, 0x5C, 0x58, 0x60, 0x68, 0x70, 0x6E, 0xFF, 0xFF},
-         {0x11, 0x0A, 0x12, 0x1A, 0x22, 0x23, 0x2B, 0x2A, 0x32, 0x3A, 0x42, 0x43,
-          0x44, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x61, 0x69, 0x71, 0xFF, 0xFF, 0xFF},
-         {0x49, 0x13, 0x0C, 0x14, 0x1C, 0x24, 0x25, 0x2D, 0x2C, 0x34, 0x3C, 0x45,
-          0xFF, 0xFF, 0x4A, 0xFF, 0x50, 0xFF, 0x62, 0x6A, 0x72, 0x6F, 0xFF, 0xFF},
-         {0x06, 0x5A, 0x4B, 0xFF, 0xFF, 0xFF, 0x5B, 0xFF, 0xFF, 0xFF, 0x4D, 0x4E,
-          0x3D, 0xFF, 0x04, 0x5F, 0x5D, 0x05, 0x6B, 0xFF, 0x73, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}},
-        // Layout size M
-        // TODO: Find the key layout matrix of an ISO M keyboard
-        {{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}},
-        // Layout size S
-        // TODO: Find the key layout matrix of an ISO S keyboard
-        {{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-          0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}}
-    },
-    // TODO: If required, Japanese layouts may be added at index 2 of this array
-    // TODO: so that it remains compatible with the LibMK_Layout enum and the
-    // TODO: firmware defined layout
+const LibMK_Key LIBMK_KEYS_ANSI_L[] = {
+    // Row 0
+    {0, 0, 0x0B, 0}, {0, 1, 0x16, 0}, {0, 2, 0x1E, 0}, {0, 3, 0x19, 0},
+    {0, 4, 0x1B, 0}, {0, 6, 0x07, 0}, {0, 7, 0x33, 0}, {0, 8, 0x39, 0},
+    {0, 9, 0x3E, 0}, {0, 11, 0x56, 0}, {0, 12, 0x57, 0}, {0, 13, 0x53, 0},
+    {0, 14, 0x55, 0}, {0, 15, 0x4F, 0}, {0, 16, 0x48, 0}, {0, 17, 0x00, 0},
+    {0, 18, 0x65, 0}, {0, 19, 0x6D, 0}, {0, 20, 0x75, 0}, {0, 21, 0x77, 0},
+    // Row 1
+    {1, 0, 0x0E, 0}, {1, 1, 0x0F, 0}, {1, 2, 0x17, 0}, {1, 3, 0x1F, 0},
+    {1, 4, 0x27, 0}, {1, 5, 0x26, 0}, {1, 6, 0x2E, 0}, {1, 7, 0x2F, 0},
+    {1, 8, 0x37, 0}, {1, 9, 0x3F, 0}, {1, 10, 0x47, 0}, {1, 11, 0x46, 0},
+    {1, 12, 0x36, 0}, {1, 14, 0x51, 0}, {1, 15, 0x03, 0}, {1, 16, 0x01, 0},
+    {1, 17, 0x02, 0}, {1, 18, 0x64, 0}, {1, 19, 0x6C, 0}, {1, 20, 0x74, 0},
+    {1, 21, 0x76, 0},
+    // Row 2
+    {2, 0, 0x09, 0}, {2, 1, 0x08, 0}, {2, 2, 0x10, 0}, {2, 3, 0x18, 0},
+    {2, 4, 0x20, 0}, {2, 5, 0x21, 0}, {2, 6, 0x29, 0}, {2, 7, 0x28, 0},
+    {2, 8, 0x30, 0}, {2, 9, 0x38, 0}, {2, 10, 0x40, 0}, {2, 11, 0x41, 0},
+    {2, 12, 0x31, 0}, {2, 14, 0x52, 0}, {2, 15, 0x5E, 0}, {2, 16, 0x5C, 0},
+    {2, 17, 0x58, 0}, {2, 18, 0x60, 0}, {2, 19, 0x68, 0}, {2, 20, 0x70, 0},
+    {2, 21, 0x6E, 0},
+    // Row 3
+    {3, 0, 0x11, 0}, {3, 1, 0x0A, 0}, {3, 2, 0x12, 0}, {3, 3, 0x1A, 0},
+    {3, 4, 0x22, 0}, {3, 5, 0x23, 0}, {3, 6, 0x2B, 0}, {3, 7, 0x2A, 0},
+    {3, 8, 0x32, 0}, {3, 9, 0x3A, 0}, {3, 10, 0x42, 0}, {3, 11, 0x43, 0},
+    {3, 14, 0x54, 0}, {3, 18, 0x61, 0}, {3, 19, 0x69, 0}, {3, 20, 0x71, 0},
+    // Row 4
+    {4, 0, 0x49, 0}, {4, 2, 0x0C, 0}, {4, 3, 0x14, 0}, {4, 4, 0x1C, 0},
+    {4, 5, 0x24, 0}, {4, 6, 0x25, 0}, {4, 7, 0x2D, 0}, {4, 8, 0x2C, 0},
+    {4, 9, 0x34, 0}, {4, 10, 0x3C, 0}, {4, 11, 0x45, 0}, {4, 14, 0x4A, 0},
+    {4, 16, 0x50, 0}, {4, 18, 0x62, 0}, {4, 19, 0x6A, 0}, {4, 20, 0x72, 0},
+    {4, 21, 0x6F, 0},
+    // Row 5
+    {5, 0, 0x06, 0}, {5, 1, 0x5A, 0}, {5, 2, 0x4B, 0}, {5, 6, 0x5B, 0},
+    {5, 10, 0x4D, 0}, {5, 11, 0x4E, 0}, {5, 12, 0x3D, 0}, {5, 14, 0x04, 0},
+    {5, 15, 0x5F, 0}, {5, 16, 0x5D, 0}, {5, 17, 0x05, 0}, {5, 18, 0x6B, 0},
+    {5, 20, 0x73, 0},
+};
+
+// TODO: Find the key layout map of an ANSI M keyboard
+
+const LibMK_Key LIBMK_KEYS_ANSI_S[] = {
+    // Row 0
+    {0, 0, 0x60, 0}, {0, 1, 0x61, 0}, {0, 2, 0x62, 0}, {0, 3, 0x63, 0},
+    {0, 4, 0x68, 0}, {0, 6, 0x69, 0}, {0, 7, 0x6A, 0}, {0, 8, 0x70, 0},
+    {0, 9, 0x71, 0}, {0, 11, 0x72, 0}, {0, 12, 0x43, 0}, {0, 13, 0x44, 0},
+    {0, 14, 0x45, 0}, {0, 15, 0x66, 0}, {0, 16, 0x67, 0}, {0, 17, 0x6B, 0},
+    // Row 1
+    {1, 0, 0x00, 0}, {1, 1, 0x01, 0}, {1, 2, 0x08, 0}, {1, 3, 0x09, 0},
+    {1, 4, 0x10, 0}, {1, 5, 0x11, 0}, {1, 6, 0x18, 0}, {1, 7, 0x19, 0},
+    {1, 8, 0x20, 0}, {1, 9, 0x21, 0}, {1, 10, 0x28, 0}, {1, 11, 0x29, 0},
+    {1, 12, 0x30, 0}, {1, 14, 0x31, 0}, {1, 15, 0x38, 0}, {1, 16, 0x39, 0},
+    {1, 17, 0x40, 0},
+    // Row 2
+    {2, 0, 0x02, 0}, {2, 1, 0x03, 0}, {2, 2, 0x0A, 0}, {2, 3, 0x0B, 0},
+    {2, 4, 0x12, 0}, {2, 5, 0x13, 0}, {2, 6, 0x1A, 0}, {2, 7, 0x1B, 0},
+    {2, 8, 0x22, 0}, {2, 9, 0x23, 0}, {2, 10, 0x2A, 0}, {2, 11, 0x2B, 0},
+    {2, 12, 0x32, 0}, {2, 14, 0x33, 0}, {2, 15, 0x3A, 0}, {2, 16, 0x3B, 0},
+    {2, 17, 0x42, 0},
+    // Row 3
+    {3, 0, 0x04, 0}, {3, 1, 0x05, 0}, {3, 2, 0x0C, 0}, {3, 3, 0x0D, 0},
+    {3, 4, 0x14, 0}, {3, 5, 0x15, 0}, {3, 6, 0x1C, 0}, {3, 7, 0x1D, 0},
+    {3, 8, 0x24, 0}, {3, 9, 0x25, 0}, {3, 10, 0x2C, 0}, {3, 11, 0x2D, 0},
+    {3, 14, 0x34, 0},
+    // Row 4
+    {4, 0, 0x06, 0}, {4, 2, 0x07, 0}, {4, 3, 0x0E, 0}, {4, 4, 0x0F, 0},
+    {4, 5, 0x16, 0}, {4, 6, 0x17, 0}, {4, 7, 0x1E, 0}, {4, 8, 0x1F, 0},
+    {4, 9, 0x26, 0}, {4, 10, 0x27, 0}, {4, 11, 0x2E, 0}, {4, 12, 0x01, 0},
+    {4, 14, 0x2F, 0}, {4, 16, 0x3D, 0},
+    // Row 5
+    {5, 0, 0x5B, 0}, {5, 1, 0x5A, 0}, {5, 2, 0x5C, 0}, {5, 6, 0x5D, 0},
+    {5, 10, 0x5E, 0}, {5, 11, 0x3C, 0}, {5, 12, 0x5F, 0}, {5, 14, 0x36, 0},
+    {5, 15, 0x3F, 0}, {5, 16, 0x3E, 0}, {5, 17, 0x46, 0},
+};
+
+const LibMK_Key LIBMK_KEYS_ISO_L[] = {
+    // Row 0
+    {0, 0, 0x0B, 0}, {0, 1, 0x16, 0}, {0, 2, 0x1E, 0}, {0, 3, 0x19, 0},
+    {0, 4, 0x1B, 0}, {0, 6, 0x07, 0}, {0, 7, 0x33, 0}, {0, 8, 0x39, 0},
+    {0, 9, 0x3E, 0}, {0, 11, 0x56, 0}, {0, 12, 0x57, 0}, {0, 13, 0x53, 0},
+    {0, 14, 0x55, 0}, {0, 15, 0x4F, 0}, {0, 16, 0x48, 0}, {0, 17, 0x00, 0},
+    {0, 18, 0x65, 0}, {0, 19, 0x6D, 0}, {0, 20, 0x75, 0}, {0, 21, 0x77, 0},
+    // Row 1
+    {1, 0, 0x0E, 0}, {1, 1, 0x0F, 0}, {1, 2, 0x17, 0}, {1, 3, 0x1F, 0},
+    {1, 4, 0x27, 0}, {1, 5, 0x26, 0}, {1, 6, 0x2E, 0}, {1, 7, 0x2F, 0},
+    {1, 8, 0x37, 0}, {1, 9, 0x3F, 0}, {1, 10, 0x47, 0}, {1, 11, 0x46, 0},
+    {1, 12, 0x36, 0}, {1, 14, 0x51, 0}, {1, 15, 0x03, 0}, {1, 16, 0x01, 0},
+    {1, 17, 0x02, 0}, {1, 18, 0x64, 0}, {1, 19, 0x6C, 0}, {1, 20, 0x74, 0},
+    {1, 21, 0x76, 0},
+    // Row 2
+    {2, 0, 0x09, 0}, {2, 1, 0x08, 0}, {2, 2, 0x10, 0}, {2, 3, 0x18, 0},
+    {2, 4, 0x20, 0}, {2, 5, 0x21, 0}, {2, 6, 0x29, 0}, {2, 7, 0x28, 0},
+    {2, 8, 0x30, 0}, {2, 9, 0x38, 0}, {2, 10, 0x40, 0}, {2, 11, 0x41, 0},
+    {2, 12, 0x31, 0}, {2, 14, 0x54, 0}, {2, 15, 0x5E, 0}, {2, 16, 0x5C, 0},
+    {2, 17, 0x58, 0}, {2, 18, 0x60, 0}, {2, 19, 0x68, 0}, {2, 20, 0x70, 0},
+    {2, 21, 0x6E, 0},
+    // Row 3
+    {3, 0, 0x11, 0}, {3, 1, 0x0A, 0}, {3, 2, 0x12, 0}, {3, 3, 0x1A, 0},
+    {3, 4, 0x22, 0}, {3, 5, 0x23, 0}, {3, 6, 0x2B, 0}, {3, 7, 0x2A, 0},
+    {3, 8, 0x32, 0}, {3, 9, 0x3A, 0}, {3, 10, 0x42, 0}, {3, 11, 0x43, 0},
+    {3, 12, 0x44, 0}, {3, 18, 0x61, 0}, {3, 19, 0x69, 0}, {3, 20, 0x71, 0},
+    // Row 4
+    {4, 0, 0x49, 0}, {4, 1, 0x13, 0}, {4, 2, 0x0C, 0}, {4, 3, 0x14, 0},
+    {4, 4, 0x1C, 0}, {4, 5, 0x24, 0}, {4, 6, 0x25, 0}, {4, 7, 0x2D, 0},
+    {4, 8, 0x2C, 0}, {4, 9, 0x34, 0}, {4, 10, 0x3C, 0}, {4, 11, 0x45, 0},
+    {4, 14, 0x4A, 0}, {4, 16, 0x50, 0}, {4, 18, 0x62, 0}, {4, 19, 0x6A, 0},
+    {4, 20, 0x72, 0}, {4, 21, 0x6F, 0},
+    // Row 5
+    {5, 0, 0x06, 0}, {5, 1, 0x5A, 0}, {5, 2, 0x4B, 0}, {5, 6, 0x5B, 0},
+    {5, 10, 0x4D, 0}, {5, 11, 0x4E, 0}, {5, 12, 0x3D, 0}, {5, 14, 0x04, 0},
+    {5, 15, 0x5F, 0}, {5, 16, 0x5D, 0}, {5, 17, 0x05, 0}, {5, 18, 0x6B, 0},
+    {5, 20, 0x73, 0},
+};
+
+// TODO: Find the key layout maps of ISO M and ISO S keyboards
+// TODO: If required, Japanese layouts may be added with LIBMK_LAYOUT_JP
+
+/// Built-in maps, the indices are built upon first use
+static LibMK_KeyMap BuiltinKeyMaps[] = {
+    {0, LIBMK_LAYOUT_ANSI, LIBMK_L, LIBMK_KEYS_ANSI_L,
+     sizeof(LIBMK_KEYS_ANSI_L) / sizeof(LibMK_Key), {{0}}, {0}, NULL, 0, NULL},
+    {0, LIBMK_LAYOUT_ANSI, LIBMK_S, LIBMK_KEYS_ANSI_S,
+     sizeof(LIBMK_KEYS_ANSI_S) / sizeof(LibMK_Key), {{0}}, {0}, NULL, 0, NULL},
+    {0, LIBMK_LAYOUT_ISO, LIBMK_L, LIBMK_KEYS_ISO_L,
+     sizeof(LIBMK_KEYS_ISO_L) / sizeof(LibMK_Key), {{0}}, {0}, NULL, 0, NULL},
 };
 
 
+
 bool libmk_init(void) {
     int result = libusb_init(&Context);
 #ifdef LIBMK_USB_DEBUG
@@ -188,119 +272,720 @@ bool libmk_init(void) {
 
 
 int libmk_exit(void) {
+    libmk_stop_registry();
     if (DeviceHandle != NULL) {
         int r = libmk_free_handle(DeviceHandle);
         if (r != LIBMK_SUCCESS)
             return r;
     }
+    libmk_set_cache_file(NULL);
+    libmk_clear_descriptors();
+    libmk_clear_keymaps();
     libusb_exit(Context);
     return LIBMK_SUCCESS;
 }
 
 
 int libmk_detect_devices(LibMK_Model** model_list) {
-    libusb_device** devices = NULL;
-    ssize_t amount = libusb_get_device_list(Context, &devices);
+    LibMK_Device** devices;
+    int n = libmk_detect(&devices);
+    if (n < 0)
+        return n;
+
+    // Now build an array of Model numbers
+    LibMK_Model* models = (LibMK_Model*) malloc(sizeof(LibMK_Model) * n);
+    *model_list = models;
+    for (int j = 0; j < n; j++)
+        models[j] = devices[j]->model;
+    libmk_free_device_list(devices, true);
+    return n;
+}
+
+
+int libmk_detect(LibMK_Device*** devices) {
+    // The registry already knows the devices attached
+    pthread_mutex_lock(&RegistryLock);
+    if (RegistryRunning) {
+        *devices = (LibMK_Device**) malloc(
+            sizeof(LibMK_Device*) * (RegistrySize + 1));
+        if (*devices == NULL) {
+            pthread_mutex_unlock(&RegistryLock);
+            return LIBMK_ERR_NO_MEMORY;
+        }
+        int n = 0;
+        for (LibMK_Device* d = RegistryDevices; d != NULL; d = d->next)
+            (*devices)[n++] = libmk_ref_device(d);
+        pthread_mutex_unlock(&RegistryLock);
+        (*devices)[n] = NULL;
+        return n;
+    }
+    pthread_mutex_unlock(&RegistryLock);
+
+    libusb_device** list = NULL;
+    ssize_t amount = libusb_get_device_list(Context, &list);
     if (amount < 0)
         return LIBMK_ERR_DEV_LIST;
+    *devices = (LibMK_Device**) malloc(sizeof(LibMK_Device*) * (amount + 1));
+    if (*devices == NULL) {
+        libusb_free_device_list(list, true);
+        return LIBMK_ERR_NO_MEMORY;
+    }
 
+    // Build an array of records of supported devices
     int n = 0;
-    libusb_device* current = NULL;
-    LibMK_Device* list = NULL;
-    LibMK_Device* temp = NULL;
-
-    // Build a linked list of Device structs of supported devices
     for (ssize_t i = 0; i < amount; i++) {
-        current = devices[i];
-        if (current == NULL)
-            break;
-        temp = libmk_open_device(current);
-        if (temp == NULL)  // Not a MasterKeys device
+        LibMK_Device* device = libmk_open_device(list[i]);
+        if (device == NULL)  // Not a MasterKeys device
             continue;
+        (*devices)[n++] = device;
+    }
+    (*devices)[n] = NULL;
+    // The records hold their own references to the devices
+    libusb_free_device_list(list, true);
+    return n;
+}
 
-        list = libmk_append_device(list, temp);
-        n = n + 1;
+
+int libmk_start_registry(LibMK_DeviceCallback callback, void* data) {
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return LIBMK_ERR_UNSUPPORTED;
+    pthread_mutex_lock(&RegistryLock);
+    if (RegistryRunning) {
+        pthread_mutex_unlock(&RegistryLock);
+        return LIBMK_ERR_STILL_ACTIVE;
+    }
+    RegistryExit = false;
+    RegistryCallback = NULL;
+    pthread_mutex_unlock(&RegistryLock);
+
+    // The devices already attached are enumerated during registration
+    int r = libusb_hotplug_register_callback(
+        Context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+            LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_ENUMERATE, LIBMK_VENDOR_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+        LIBUSB_HOTPLUG_MATCH_ANY, libmk_hotplug_callback, NULL,
+        &RegistryHotplug);
+    if (r != LIBUSB_SUCCESS)
+        return LIBMK_ERR_UNSUPPORTED;
+    pthread_mutex_lock(&RegistryLock);
+    while (RegistryEvents != NULL) {
+        LibMK_HotplugEvent* event = RegistryEvents;
+        RegistryEvents = event->next;
+        pthread_mutex_unlock(&RegistryLock);
+        libmk_process_hotplug(event, false);
+        pthread_mutex_lock(&RegistryLock);
+    }
+    RegistryCallback = callback;
+    RegistryData = data;
+    RegistryRunning = true;
+    pthread_mutex_unlock(&RegistryLock);
+
+    r = libmk_start_event_thread();
+    if (r == LIBMK_SUCCESS &&
+            pthread_create(&RegistryThread, NULL, libmk_run_registry, NULL) != 0) {
+        libmk_stop_event_thread();
+        r = LIBMK_ERR_THREAD;
+    }
+    if (r != LIBMK_SUCCESS) {
+        libusb_hotplug_deregister_callback(Context, RegistryHotplug);
+        pthread_mutex_lock(&RegistryLock);
+        libmk_clear_registry();
+        pthread_mutex_unlock(&RegistryLock);
     }
+    return r;
+}
 
-    // Now build an array of Model numbers
-    LibMK_Model* models = (LibMK_Model*) malloc(sizeof(LibMK_Model) * n);
-    *model_list = models;
-    temp = list;
-    LibMK_Device* to_free;
-    for (int j = 0; j < n; j++) {
-        models[j] = temp->model;
-        to_free = temp;
-        if (temp->next != NULL)
-            temp = temp->next;
-        libmk_free_device(to_free);
+
+void libmk_stop_registry(void) {
+    pthread_mutex_lock(&RegistryLock);
+    if (!RegistryRunning) {
+        pthread_mutex_unlock(&RegistryLock);
+        return;
     }
-    return n;
+    pthread_mutex_unlock(&RegistryLock);
+    libusb_hotplug_deregister_callback(Context, RegistryHotplug);
+    libmk_stop_event_thread();
+
+    pthread_mutex_lock(&RegistryLock);
+    RegistryExit = true;
+    pthread_cond_signal(&RegistryCond);
+    pthread_mutex_unlock(&RegistryLock);
+    pthread_join(RegistryThread, NULL);
+
+    pthread_mutex_lock(&RegistryLock);
+    libmk_clear_registry();
+    pthread_mutex_unlock(&RegistryLock);
 }
 
 
-LibMK_Device* libmk_open_device(libusb_device* device) {
-    int r;
-    struct libusb_device_descriptor descriptor;
-    libusb_device_handle* handle = NULL;
-    unsigned char* manufacturer =
-        (unsigned char*) malloc(LIBMK_USB_DESCR_LEN * sizeof(unsigned char));
-    unsigned char* product =
-        (unsigned char*) malloc(LIBMK_USB_DESCR_LEN * sizeof(unsigned char));
-
-    // Get the device descriptor of the next device
-    r = libusb_get_device_descriptor(device, &descriptor);
-    if (r < 0)
-        return NULL;
+void libmk_clear_registry(void) {
+    while (RegistryEvents != NULL) {
+        LibMK_HotplugEvent* event = RegistryEvents;
+        RegistryEvents = event->next;
+        libusb_unref_device(event->device);
+        free(event);
+    }
+    while (RegistryPending != NULL) {
+        LibMK_HotplugEvent* event = RegistryPending;
+        RegistryPending = event->next;
+        libusb_unref_device(event->device);
+        free(event);
+    }
+    while (RegistryDevices != NULL) {
+        LibMK_Device* device = RegistryDevices;
+        RegistryDevices = device->next;
+        libmk_unref_device(device);
+    }
+    RegistrySize = 0;
+    RegistryCallback = NULL;
+    RegistryRunning = false;
+}
 
-    // Open the device and decode the descriptor strings
-    r = libusb_open(device, &handle);
-    if (r < 0)
-        return NULL;
 
-    libusb_get_string_descriptor_ascii(
-        handle, descriptor.iManufacturer,
-        manufacturer, LIBMK_USB_DESCR_LEN);
-    libusb_get_string_descriptor_ascii(
-        handle, descriptor.iProduct,
-        product, LIBMK_USB_DESCR_LEN);
+int libmk_hotplug_callback(
+        libusb_context* context, libusb_device* device,
+        libusb_hotplug_event event, void* data) {
+    // Devices may not be opened while handling events, so the events
+    // are processed by the registry thread
+    LibMK_HotplugEvent* entry =
+        (LibMK_HotplugEvent*) malloc(sizeof(LibMK_HotplugEvent));
+    if (entry == NULL)
+        return 0;
+    entry->device = libusb_ref_device(device);
+    entry->arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+    entry->attempts = 0;
+    entry->next = NULL;
+    pthread_mutex_lock(&RegistryLock);
+    LibMK_HotplugEvent** last = &RegistryEvents;
+    while (*last != NULL)
+        last = &(*last)->next;
+    *last = entry;
+    pthread_cond_signal(&RegistryCond);
+    pthread_mutex_unlock(&RegistryLock);
+    return 0;
+}
 
-    if (strcmp((char*) manufacturer, MANUFACTURER) != 0)
-        return NULL;
+
+void* libmk_run_registry(void* arg) {
+    pthread_mutex_lock(&RegistryLock);
+    while (true) {
+        // Pending arrivals are retried once no events came in for a while
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LIBMK_HOTPLUG_RETRY * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        bool retry = false;
+        while (!RegistryExit && RegistryEvents == NULL && !retry) {
+            if (RegistryPending == NULL)
+                pthread_cond_wait(&RegistryCond, &RegistryLock);
+            else
+                retry = pthread_cond_timedwait(
+                    &RegistryCond, &RegistryLock, &deadline) != 0;
+        }
+        if (RegistryExit)
+            break;
+        LibMK_HotplugEvent* events = RegistryEvents;
+        RegistryEvents = NULL;
+        if (events == NULL) {
+            events = RegistryPending;
+            RegistryPending = NULL;
+        }
+        pthread_mutex_unlock(&RegistryLock);
+        while (events != NULL) {
+            LibMK_HotplugEvent* next = events->next;
+            libmk_process_hotplug(events, true);
+            events = next;
+        }
+        pthread_mutex_lock(&RegistryLock);
+    }
+    pthread_mutex_unlock(&RegistryLock);
+    return NULL;
+}
+
+
+void libmk_process_hotplug(LibMK_HotplugEvent* event, bool callback) {
+    LibMK_Device* device = NULL;
+    if (event->arrived) {
+        // Reads the string descriptors if the device is not yet known
+        pthread_mutex_lock(&RegistryLock);
+        LibMK_Device* known = RegistryDevices;
+        while (known != NULL && known->device != event->device)
+            known = known->next;
+        pthread_mutex_unlock(&RegistryLock);
+        int r = LIBMK_SUCCESS;
+        if (known == NULL)
+            r = libmk_read_device(event->device, &device);
+        // The permissions of a device that just arrived may not have
+        // been applied yet, so opening it is tried again later
+        if (r == LIBMK_ERR_DEV_OPEN_FAILED &&
+                ++event->attempts < LIBMK_HOTPLUG_ATTEMPTS) {
+            pthread_mutex_lock(&RegistryLock);
+            event->next = RegistryPending;
+            RegistryPending = event;
+            pthread_cond_signal(&RegistryCond);
+            pthread_mutex_unlock(&RegistryLock);
+            return;
+        }
+        if (device != NULL) {
+            pthread_mutex_lock(&RegistryLock);
+            device->next = RegistryDevices;
+            RegistryDevices = device;
+            RegistrySize++;
+            libmk_ref_device(device);
+            pthread_mutex_unlock(&RegistryLock);
+        }
+    } else {
+        pthread_mutex_lock(&RegistryLock);
+        // A device that left before it could be opened is not retried
+        LibMK_HotplugEvent** pending = &RegistryPending;
+        while (*pending != NULL) {
+            LibMK_HotplugEvent* arrival = *pending;
+            if (arrival->device != event->device) {
+                pending = &arrival->next;
+                continue;
+            }
+            *pending = arrival->next;
+            libusb_unref_device(arrival->device);
+            free(arrival);
+        }
+        LibMK_Device** current = &RegistryDevices;
+        while (*current != NULL && (*current)->device != event->device)
+            current = &(*current)->next;
+        if (*current != NULL) {
+            device = *current;
+            *current = device->next;
+            device->next = NULL;
+            RegistrySize--;
+        }
+        pthread_mutex_unlock(&RegistryLock);
+    }
+    if (device != NULL) {
+        pthread_mutex_lock(&RegistryLock);
+        LibMK_DeviceCallback notify = callback ? RegistryCallback : NULL;
+        void* data = RegistryData;
+        pthread_mutex_unlock(&RegistryLock);
+        if (notify != NULL)
+            notify(device, event->arrived, data);
+        libmk_unref_device(device);
+    }
+    libusb_unref_device(event->device);
+    free(event);
+}
+
+
+void libmk_free_device_list(LibMK_Device** devices, bool unref) {
+    for (int i = 0; unref && devices[i] != NULL; i++)
+        libmk_unref_device(devices[i]);
+    free(devices);
+}
+
+
+LibMK_Device* libmk_ref_device(LibMK_Device* device) {
+    pthread_mutex_lock(&DeviceRefsLock);
+    device->refs++;
+    pthread_mutex_unlock(&DeviceRefsLock);
+    return device;
+}
+
+
+void libmk_unref_device(LibMK_Device* device) {
+    pthread_mutex_lock(&DeviceRefsLock);
+    bool last = --device->refs == 0;
+    pthread_mutex_unlock(&DeviceRefsLock);
+    if (last)
+        libmk_free_device(device);
+}
+
+
+int libmk_open(LibMK_Device* device, LibMK_Handle** handle) {
+    if (handle == NULL)
+        handle = &DeviceHandle;
+    return libmk_create_handle(handle, device);
+}
+
+
+LibMK_Device* libmk_open_device(libusb_device* device) {
+    LibMK_Device* record;
+    libmk_read_device(device, &record);
+    return record;
+}
+
+
+int libmk_read_device(libusb_device* device, LibMK_Device** record) {
+    *record = NULL;
+    struct libusb_device_descriptor descriptor;
+    if (libusb_get_device_descriptor(device, &descriptor) < 0)
+        return LIBMK_ERR_DESCR;
+    // Only Cooler Master devices are opened, the model is identified
+    // by the product string as product IDs vary between revisions
+    if (!libmk_is_known_device(descriptor.idVendor, descriptor.idProduct))
+        return LIBMK_SUCCESS;
+
+    char manufacturer[LIBMK_USB_DESCR_LEN];
+    char product[LIBMK_USB_DESCR_LEN];
+    char serial[LIBMK_USB_DESCR_LEN];
+    int r = libmk_get_descriptor(
+        device, &descriptor, manufacturer, product, serial);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    if (strcmp(manufacturer, MANUFACTURER) != 0)
+        return LIBMK_SUCCESS;
 
     // Build a Device descriptor
-    LibMK_Model model = libmk_ident_model((char*) product);
+    LibMK_Model model = libmk_ident_model(product);
     if (model == DEV_UNKNOWN)
-        return NULL;
-
-    LibMK_Device* device_struct = libmk_create_device(
-        model, device, (char*) manufacturer, (char*) product,
+        return LIBMK_SUCCESS;
+    *record = libmk_create_device(
+        model, device, manufacturer, product, serial,
         descriptor.idVendor, descriptor.idProduct);
+    if (*record == NULL)
+        return LIBMK_ERR_NO_MEMORY;
+    (*record)->bus = libusb_get_bus_number(device);
+    (*record)->num_ports = libusb_get_port_numbers(
+        device, (*record)->ports, LIBMK_MAX_PORTS);
+    if ((*record)->num_ports < 0)
+        (*record)->num_ports = 0;
+    return LIBMK_SUCCESS;
+}
+
+
+bool libmk_is_known_device(int bVendor, int bDevice) {
+    (void) bDevice;
+    return bVendor == LIBMK_VENDOR_ID;
+}
+
+
+int libmk_get_descriptor(
+        libusb_device* device, struct libusb_device_descriptor* descriptor,
+        char* manufacturer, char* product, char* serial) {
+    unsigned char ports[LIBMK_MAX_PORTS];
+    int num_ports = libusb_get_port_numbers(device, ports, LIBMK_MAX_PORTS);
+    if (num_ports < 0)
+        num_ports = 0;
+    unsigned char bus = libusb_get_bus_number(device);
+    unsigned char address = libusb_get_device_address(device);
+
+    // A device keeps its address until it is enumerated again, so a
+    // device that was read before is not opened
+    pthread_mutex_lock(&DescriptorsLock);
+    LibMK_Descriptor* entry = Descriptors;
+    while (entry != NULL && !(
+            entry->address == address && entry->bus == bus &&
+            entry->num_ports == num_ports &&
+            memcmp(entry->ports, ports, num_ports) == 0 &&
+            entry->bVendor == descriptor->idVendor &&
+            entry->bDevice == descriptor->idProduct))
+        entry = entry->next;
+    if (entry != NULL) {
+        strcpy(manufacturer, entry->iManufacturer);
+        strcpy(product, entry->iProduct);
+        strcpy(serial, entry->iSerial);
+        pthread_mutex_unlock(&DescriptorsLock);
+        return LIBMK_SUCCESS;
+    }
+    pthread_mutex_unlock(&DescriptorsLock);
+
+    libusb_device_handle* handle;
+    if (libusb_open(device, &handle) < 0)
+        return LIBMK_ERR_DEV_OPEN_FAILED;
+    // Another keyboard of the same model may now be on the port
+    serial[0] = '\0';
+    if (descriptor->iSerialNumber != 0 && libusb_get_string_descriptor_ascii(
+            handle, descriptor->iSerialNumber,
+            (unsigned char*) serial, LIBMK_USB_DESCR_LEN) < 0)
+        serial[0] = '\0';
+    serial[LIBMK_USB_DESCR_LEN - 1] = '\0';
+
+    // The other strings may be known from the cache file or from before
+    // the device moved, devices without a serial number are identified
+    // by their port instead
+    pthread_mutex_lock(&DescriptorsLock);
+    entry = Descriptors;
+    while (entry != NULL && !(
+            entry->bVendor == descriptor->idVendor &&
+            entry->bDevice == descriptor->idProduct &&
+            strcmp(entry->iSerial, serial) == 0 && (
+                serial[0] != '\0' || (
+                    entry->bus == bus && entry->num_ports == num_ports &&
+                    memcmp(entry->ports, ports, num_ports) == 0))))
+        entry = entry->next;
+    if (entry != NULL) {
+        libmk_place_descriptor(entry, bus, ports, num_ports, address);
+        strcpy(manufacturer, entry->iManufacturer);
+        strcpy(product, entry->iProduct);
+        pthread_mutex_unlock(&DescriptorsLock);
+        libusb_close(handle);
+        return LIBMK_SUCCESS;
+    }
+    pthread_mutex_unlock(&DescriptorsLock);
+
+    int r1 = libusb_get_string_descriptor_ascii(
+        handle, descriptor->iManufacturer,
+        (unsigned char*) manufacturer, LIBMK_USB_DESCR_LEN);
+    int r2 = libusb_get_string_descriptor_ascii(
+        handle, descriptor->iProduct,
+        (unsigned char*) product, LIBMK_USB_DESCR_LEN);
     libusb_close(handle);
-    return device_struct;
+    if (r1 < 0 || r2 < 0)
+        return LIBMK_ERR_DESCR;
+    manufacturer[LIBMK_USB_DESCR_LEN - 1] = '\0';
+    product[LIBMK_USB_DESCR_LEN - 1] = '\0';
+
+    entry = (LibMK_Descriptor*) malloc(sizeof(LibMK_Descriptor));
+    if (entry == NULL)
+        return LIBMK_SUCCESS;
+    entry->bVendor = descriptor->idVendor;
+    entry->bDevice = descriptor->idProduct;
+    strcpy(entry->iManufacturer, manufacturer);
+    strcpy(entry->iProduct, product);
+    strcpy(entry->iSerial, serial);
+    entry->layout = LIBMK_LAYOUT_UNKNOWN;
+    entry->firmware[0] = '\0';
+    pthread_mutex_lock(&DescriptorsLock);
+    libmk_place_descriptor(entry, bus, ports, num_ports, address);
+    entry->next = Descriptors;
+    Descriptors = entry;
+    pthread_mutex_unlock(&DescriptorsLock);
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_place_descriptor(
+        LibMK_Descriptor* entry, unsigned char bus, unsigned char* ports,
+        int num_ports, unsigned char address) {
+    // A device that left the port is no longer found by its address
+    for (LibMK_Descriptor* other = Descriptors; other != NULL;
+            other = other->next)
+        if (other != entry && other->bus == bus &&
+                other->num_ports == num_ports &&
+                memcmp(other->ports, ports, num_ports) == 0)
+            other->address = 0;
+    entry->bus = bus;
+    entry->num_ports = num_ports;
+    memcpy(entry->ports, ports, num_ports);
+    entry->address = address;
+}
+
+
+void libmk_clear_descriptors(void) {
+    pthread_mutex_lock(&DescriptorsLock);
+    while (Descriptors != NULL) {
+        LibMK_Descriptor* next = Descriptors->next;
+        free(Descriptors);
+        Descriptors = next;
+    }
+    pthread_mutex_unlock(&DescriptorsLock);
+}
+
+
+int libmk_set_cache_file(const char* path) {
+    char* copy = NULL;
+    if (path != NULL) {
+        copy = strdup(path);
+        if (copy == NULL)
+            return LIBMK_ERR_NO_MEMORY;
+    }
+    pthread_mutex_lock(&DescriptorsLock);
+    free(CacheFile);
+    CacheFile = copy;
+    if (CacheFile != NULL)
+        libmk_load_cache();
+    pthread_mutex_unlock(&DescriptorsLock);
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_load_cache(void) {
+    FILE* file = fopen(CacheFile, "rb");
+    if (file == NULL)
+        return;
+    // An outdated or damaged cache is ignored and later replaced
+    LibMK_CacheHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, LIBMK_CACHE_MAGIC, 4) != 0 ||
+            header.version != LIBMK_CACHE_VERSION ||
+            header.entry_size != offsetof(LibMK_Descriptor, next)) {
+        fclose(file);
+        return;
+    }
+    LibMK_Descriptor** last = &Descriptors;
+    while (*last != NULL)
+        last = &(*last)->next;
+    for (unsigned int i = 0; i < header.num; i++) {
+        LibMK_Descriptor* entry = (LibMK_Descriptor*) malloc(
+            sizeof(LibMK_Descriptor));
+        if (entry == NULL)
+            break;
+        if (fread(entry, header.entry_size, 1, file) != 1 ||
+                entry->num_ports < 0 || entry->num_ports > LIBMK_MAX_PORTS) {
+            free(entry);
+            break;
+        }
+        entry->iManufacturer[LIBMK_USB_DESCR_LEN - 1] = '\0';
+        entry->iProduct[LIBMK_USB_DESCR_LEN - 1] = '\0';
+        entry->iSerial[LIBMK_USB_DESCR_LEN - 1] = '\0';
+        entry->firmware[sizeof(entry->firmware) - 1] = '\0';
+        entry->address = 0;
+        // Entries read from the devices take precedence
+        LibMK_Descriptor* known = Descriptors;
+        while (known != NULL && !(
+                known->bVendor == entry->bVendor &&
+                known->bDevice == entry->bDevice &&
+                strcmp(known->iSerial, entry->iSerial) == 0 && (
+                    entry->iSerial[0] != '\0' || (
+                        known->bus == entry->bus &&
+                        known->num_ports == entry->num_ports &&
+                        memcmp(known->ports, entry->ports,
+                               entry->num_ports) == 0))))
+            known = known->next;
+        if (known != NULL) {
+            free(entry);
+            continue;
+        }
+        entry->next = NULL;
+        *last = entry;
+        last = &entry->next;
+    }
+    fclose(file);
+}
+
+
+int libmk_save_cache(void) {
+    if (CacheFile == NULL)
+        return LIBMK_SUCCESS;
+    LibMK_CacheHeader header;
+    memcpy(header.magic, LIBMK_CACHE_MAGIC, 4);
+    header.version = LIBMK_CACHE_VERSION;
+    header.entry_size = offsetof(LibMK_Descriptor, next);
+    header.num = 0;
+    for (LibMK_Descriptor* e = Descriptors; e != NULL; e = e->next)
+        if (e->layout != LIBMK_LAYOUT_UNKNOWN)
+            header.num++;
+
+    // Readers never observe a partially written file
+    size_t len = strlen(CacheFile) + 5;
+    char temp[len];
+    snprintf(temp, len, "%s.tmp", CacheFile);
+    FILE* file = fopen(temp, "wb");
+    if (file == NULL)
+        return LIBMK_ERR_FILE;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (LibMK_Descriptor* e = Descriptors; written && e != NULL; e = e->next)
+        if (e->layout != LIBMK_LAYOUT_UNKNOWN)
+            written = fwrite(e, header.entry_size, 1, file) == 1;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temp, CacheFile) != 0) {
+        remove(temp);
+        return LIBMK_ERR_FILE;
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+LibMK_Descriptor* libmk_find_descriptor(LibMK_Device* device) {
+    LibMK_Descriptor* entry = Descriptors;
+    while (entry != NULL && !(
+            entry->bVendor == device->bVendor &&
+            entry->bDevice == device->bDevice &&
+            strcmp(entry->iSerial, device->iSerial) == 0 && (
+                device->iSerial[0] != '\0' || (
+                    entry->bus == device->bus &&
+                    entry->num_ports == device->num_ports &&
+                    memcmp(entry->ports, device->ports,
+                           device->num_ports) == 0))))
+        entry = entry->next;
+    return entry;
+}
+
+
+bool libmk_get_cached_layout(LibMK_Handle* handle) {
+    if (handle->device == NULL)
+        return false;
+    pthread_mutex_lock(&DescriptorsLock);
+    LibMK_Descriptor* entry = libmk_find_descriptor(handle->device);
+    bool cached = entry != NULL && entry->layout != LIBMK_LAYOUT_UNKNOWN;
+    if (cached)
+        handle->layout = entry->layout;
+    pthread_mutex_unlock(&DescriptorsLock);
+    return cached;
+}
+
+
+void libmk_cache_firmware(LibMK_Handle* handle, LibMK_Firmware* fw) {
+    if (handle->device == NULL)
+        return;
+    pthread_mutex_lock(&DescriptorsLock);
+    LibMK_Descriptor* entry = libmk_find_descriptor(handle->device);
+    bool changed = entry != NULL && (
+        entry->layout != (LibMK_Layout) fw->layout ||
+        strcmp(entry->firmware, fw->string) != 0);
+    if (changed) {
+        entry->layout = (LibMK_Layout) fw->layout;
+        strcpy(entry->firmware, fw->string);
+        libmk_save_cache();
+    }
+    pthread_mutex_unlock(&DescriptorsLock);
+}
+
+
+int libmk_confirm_cache(LibMK_Handle* handle) {
+    if (!handle->confirm)
+        return LIBMK_SUCCESS;
+    handle->confirm = false;
+    LibMK_Firmware* fw;
+    int r = libmk_get_firmware_version(handle, &fw);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    if (handle->layout != (LibMK_Layout) fw->layout) {
+        handle->layout = (LibMK_Layout) fw->layout;
+        libmk_build_scatter(handle);
+        handle->shadow_valid = false;
+    }
+    libmk_cache_firmware(handle, fw);
+    free(fw);
+    return LIBMK_SUCCESS;
 }
 
 
 LibMK_Device* libmk_create_device(LibMK_Model model, libusb_device* dev,
                                   char* iManufacturer, char* iProduct,
-                                  int bVendor, int bDevice) {
+                                  char* iSerial, int bVendor, int bDevice) {
     char* m_str = (char*) malloc((strlen(iManufacturer) + 1) * sizeof(char));
     char* p_str = (char*) malloc((strlen(iProduct) + 1) * sizeof(char));
+    char* s_str = (char*) malloc((strlen(iSerial) + 1) * sizeof(char));
+    LibMK_Device* device = (LibMK_Device*) malloc(sizeof(LibMK_Device));
+    if (m_str == NULL || p_str == NULL || s_str == NULL || device == NULL) {
+        free(m_str);
+        free(p_str);
+        free(s_str);
+        free(device);
+        return NULL;
+    }
     strcpy(m_str, iManufacturer);
     strcpy(p_str, iProduct);
-    LibMK_Device* device = (LibMK_Device*) malloc(sizeof(LibMK_Device));
+    strcpy(s_str, iSerial);
     device->iManufacturer = m_str;
     device->iProduct = p_str;
+    device->iSerial = s_str;
     device->bVendor = bVendor;
     device->bDevice = bDevice;
-    device->device = dev;
+    device->device = dev == NULL ? NULL : libusb_ref_device(dev);
     device->model = model;
+    device->next = NULL;
+    device->bus = 0;
+    device->num_ports = 0;
+    device->refs = 1;
     return device;
 }
 
 
 void libmk_free_device(LibMK_Device* device) {
+    if (device->device != NULL)
+        libusb_unref_device(device->device);
     free(device->iManufacturer);
     free(device->iProduct);
+    free(device->iSerial);
     free(device);
 }
 
@@ -318,17 +1003,82 @@ LibMK_Device* libmk_append_device(LibMK_Device* first_device,
 
 
 int libmk_create_handle(LibMK_Handle** handle, LibMK_Device* device) {
-    *handle = (LibMK_Handle*) malloc(sizeof(LibMK_Handle));
-    if (*handle == NULL)
-        return LIBMK_ERR_DEV_OPEN_FAILED;
-    int r = libusb_open(device->device, &(*handle)->handle);
-    if (r != 0)
+    int r = libmk_alloc_handle(handle, device->model);
+    if (r != LIBMK_SUCCESS)
+        return r;
+    r = libusb_open(device->device, &(*handle)->handle);
+    if (r != 0) {
+        libmk_free_handle(*handle);
+        *handle = NULL;
         return LIBMK_ERR_DEV_OPEN_FAILED;
+    }
     (*handle)->open = true;
-    (*handle)->model = device->model;
+    (*handle)->transport = &LIBMK_USB_TRANSPORT;
+    (*handle)->device = libmk_ref_device(device);
     (*handle)->bDevice = device->bDevice;
     (*handle)->bVendor = device->bVendor;
-    LibMK_Model model = device->model;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_alloc_handle(LibMK_Handle** handle, LibMK_Model model) {
+    *handle = (LibMK_Handle*) malloc(sizeof(LibMK_Handle));
+    if (*handle == NULL)
+        return LIBMK_ERR_DEV_OPEN_FAILED;
+    void* buffers;
+    if (posix_memalign(&buffers, LIBMK_CACHE_LINE, sizeof(LibMK_Buffers)) != 0) {
+        free(*handle);
+        *handle = NULL;
+        return LIBMK_ERR_DEV_OPEN_FAILED;
+    }
+    (*handle)->buffers = (LibMK_Buffers*) buffers;
+    for (int i = 0; i < LIBMK_PIPELINE_DEPTH; i++) {
+        (*handle)->out[i] = libusb_alloc_transfer(0);
+        (*handle)->in[i] = libusb_alloc_transfer(0);
+        if ((*handle)->out[i] == NULL || (*handle)->in[i] == NULL) {
+            for (int j = 0; j <= i; j++) {
+                libusb_free_transfer((*handle)->out[j]);
+                libusb_free_transfer((*handle)->in[j]);
+            }
+            free((*handle)->buffers);
+            free(*handle);
+            *handle = NULL;
+            return LIBMK_ERR_DEV_OPEN_FAILED;
+        }
+    }
+    (*handle)->handle = NULL;
+    (*handle)->open = false;
+    (*handle)->shadow_valid = false;
+    (*handle)->tolerance = 0;
+    (*handle)->ack_policy = LIBMK_ACK_ALL;
+    (*handle)->mode_valid = false;
+    (*handle)->effect_valid = false;
+    (*handle)->layout = LIBMK_LAYOUT_UNKNOWN;
+    (*handle)->keymap = NULL;
+    (*handle)->scatter.num = 0;
+    (*handle)->presenter = NULL;
+    pthread_mutex_init(&(*handle)->presenter_lock, NULL);
+    (*handle)->transport = NULL;
+    (*handle)->simulator = NULL;
+    (*handle)->device = NULL;
+    (*handle)->detached = false;
+    (*handle)->recovery_attempts = 0;
+    (*handle)->recovery_backoff = 0;
+    (*handle)->recovering = false;
+    (*handle)->confirm = false;
+    memset(&(*handle)->stats, 0, sizeof(LibMK_Stats));
+    memset(&(*handle)->pipeline, 0, sizeof(LibMK_Pipeline));
+    pthread_mutex_init(&(*handle)->pipeline_lock, NULL);
+    // Commands are composed of other commands, so the lock is reentrant
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&(*handle)->command_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    (*handle)->locks = 0;
+    (*handle)->model = model;
+    (*handle)->bDevice = 0;
+    (*handle)->bVendor = 0;
     if (model == DEV_RGB_L || model == DEV_WHITE_L)
         (*handle)->size = LIBMK_L;
     else if (model == DEV_RGB_M || model == DEV_WHITE_M)
@@ -336,7 +1086,8 @@ int libmk_create_handle(LibMK_Handle** handle, LibMK_Device* device) {
     else if (model == DEV_RGB_S || model == DEV_WHITE_S)
         (*handle)->size = LIBMK_S;
     else {
-        libusb_close((*handle)->handle);
+        libmk_free_handle(*handle);
+        *handle = NULL;
         return LIBMK_ERR_UNKNOWN_LAYOUT;
     }
     return LIBMK_SUCCESS;
@@ -346,6 +1097,23 @@ int libmk_create_handle(LibMK_Handle** handle, LibMK_Device* device) {
 int libmk_free_handle(LibMK_Handle* handle) {
     if (handle->open)
         return LIBMK_ERR_DEV_NOT_CLOSED;
+    // A handle that was never opened may still use the event thread
+    if (handle->ack_policy == LIBMK_ACK_DEFERRED)
+        libmk_stop_event_thread();
+    for (int i = 0; i < LIBMK_PIPELINE_DEPTH; i++) {
+        libusb_free_transfer(handle->out[i]);
+        libusb_free_transfer(handle->in[i]);
+    }
+    pthread_mutex_destroy(&handle->pipeline_lock);
+    pthread_mutex_destroy(&handle->command_lock);
+    pthread_mutex_destroy(&handle->presenter_lock);
+    if (handle->simulator != NULL) {
+        pthread_mutex_destroy(&handle->simulator->lock);
+        free(handle->simulator);
+    }
+    if (handle->device != NULL)
+        libmk_unref_device(handle->device);
+    free(handle->buffers);
     free(handle);
     return LIBMK_SUCCESS;
 }
@@ -353,62 +1121,28 @@ int libmk_free_handle(LibMK_Handle* handle) {
 
 int libmk_set_device(LibMK_Model model, LibMK_Handle** handle) {
     libusb_device** devices;
-    ssize_t amount = libusb_get_device_list(NULL, &devices);
+    ssize_t amount = libusb_get_device_list(Context, &devices);
     if (amount < 0)
         return LIBMK_ERR_DEV_LIST;
 
-    // Variables required for looping over the device list
-    int r;  // libusb requires error handling with return values
-    libusb_device* current = NULL;
-    libusb_device* device = NULL;
-    struct libusb_device_descriptor descriptor;
-    libusb_device_handle* usb_handle;
-
-    // Strings to store decoded device descriptors in
-    unsigned char manufacturer[LIBMK_USB_DESCR_LEN];
-    unsigned char product[LIBMK_USB_DESCR_LEN];
-
-    for (ssize_t i = 0; i < amount; i++) {
-
-        // Get the device descriptor of the next device
-        current = devices[i];
-        r = libusb_get_device_descriptor(current, &descriptor);
-        if (r < 0)
-            return LIBMK_ERR_DESCR;
-
-        // Open the device and decode the descriptor strings
-        r = libusb_open(current, &usb_handle);
-        if (r < 0)
-            return LIBMK_ERR_DEV_OPEN_FAILED;
-        libusb_get_string_descriptor_ascii(
-            usb_handle, descriptor.iManufacturer,
-            manufacturer, LIBMK_USB_DESCR_LEN);
-        libusb_get_string_descriptor_ascii(
-            usb_handle, descriptor.iProduct,
-            product, LIBMK_USB_DESCR_LEN);
-
-        // Determine whether this is a valid MasterKeys keyboard device
-        if (strcmp((char*) manufacturer, MANUFACTURER) == 0) {
-            if (model == DEV_ANY
-                || libmk_ident_model((char*) product) == model) {
-
-                device = current;
-                libusb_close(usb_handle);
-                break;
-            }
+    // Choose the first supported device of the model requested
+    LibMK_Device* device = NULL;
+    for (ssize_t i = 0; i < amount && device == NULL; i++) {
+        device = libmk_open_device(devices[i]);
+        if (device != NULL && model != DEV_ANY && device->model != model) {
+            libmk_unref_device(device);
+            device = NULL;
         }
-        libusb_close(usb_handle);
     }
 
-    if (device == NULL)
-        // No devices detected
-        return LIBMK_ERR_DEV_NOT_CONNECTED;
-
-    // Open the device into the handle
-    LibMK_Device* dev = libmk_open_device(device);
-    if (handle == NULL)
-        handle = &DeviceHandle;
-    r = libmk_create_handle(handle, dev);
+    int r = LIBMK_ERR_DEV_NOT_CONNECTED;
+    if (device != NULL) {
+        // Open the device into the handle
+        if (handle == NULL)
+            handle = &DeviceHandle;
+        r = libmk_create_handle(handle, device);
+        libmk_unref_device(device);
+    }
     libusb_free_device_list(devices, true);
     return r;
 }
@@ -450,12 +1184,15 @@ int libmk_enable_control(LibMK_Handle* handle) {
         return LIBMK_ERR_DEV_NOT_SET;
 
     // Claim the interface on the device
+    pthread_mutex_lock(&handle->command_lock);
     r = libmk_claim_interface(handle);
     if (r != LIBMK_SUCCESS)
-        return LIBMK_ERR_IFACE_CLAIM_FAILED;
-
-    // Send the enable control packet to the keyboard
-    return libmk_send_control_packet(handle);
+        r = LIBMK_ERR_IFACE_CLAIM_FAILED;
+    else
+        // Send the enable control packet to the keyboard
+        r = libmk_send_control_packet(handle);
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
 }
 
 
@@ -463,374 +1200,2048 @@ int libmk_send_control_packet(LibMK_Handle* handle) {
     int r = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
     if (r != LIBMK_SUCCESS)
         return r;
-    LibMK_Firmware* fw;
-    r = libmk_get_firmware_version(handle, &fw);
-    if (r != LIBMK_SUCCESS) {
-        libusb_close(handle->handle);
-        return r;
+    // A cached layout is confirmed once the first colors have been set
+    handle->confirm = libmk_get_cached_layout(handle);
+    if (!handle->confirm) {
+        LibMK_Firmware* fw;
+        r = libmk_get_firmware_version(handle, &fw);
+        if (r != LIBMK_SUCCESS)
+            return r;
+        handle->layout = fw->layout;
+        libmk_cache_firmware(handle, fw);
+        free(fw);
     }
-    handle->layout = fw->layout;
+    // An unsupported layout is only reported when setting colors
+    libmk_build_scatter(handle);
     return LIBMK_SUCCESS;
 }
 
 
 int libmk_disable_control(LibMK_Handle* handle) {
-    if (handle == NULL)
-        handle = DeviceHandle;
-    if (handle == NULL)
-        return LIBMK_ERR_DEV_NOT_SET;
-
-    int r = libmk_set_control_mode(handle, LIBMK_FIRMWARE_CTRL);
-    if (r != LIBMK_SUCCESS)
-        return r;
+    return libmk_end_control(handle, true);
+}
 
-    r = libusb_release_interface(handle->handle, LIBMK_IFACE_NUM);
-    if (r < 0)
-        return LIBMK_ERR_IFACE_RELEASE_FAILED;
 
-    libusb_close(handle->handle);
-    handle->open = false;
-    if (handle == DeviceHandle) {
-        libmk_free_handle(handle);
-        DeviceHandle = NULL;
-    }
-    libusb_reset_device(handle->handle);
-    return LIBMK_SUCCESS;
+int libmk_handoff_control(LibMK_Handle* handle) {
+    return libmk_end_control(handle, false);
 }
 
 
-int libmk_claim_interface(LibMK_Handle* handle) {
-    int r;
+int libmk_end_control(LibMK_Handle* handle, bool reset) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
 
-    // Unload the kernel driver for the device if it is active
-    if (libusb_kernel_driver_active(handle->handle, LIBMK_IFACE_NUM)) {
-        r = libusb_detach_kernel_driver(handle->handle, LIBMK_IFACE_NUM);
-        if (r < 0)
-            return LIBMK_ERR_KERNEL_DRIVER;
+    // The presenter takes the command lock to present its frames
+    if (libmk_stop_presenter(handle) == LIBMK_ERR_STILL_ACTIVE)
+        return LIBMK_ERR_STILL_ACTIVE;
+    pthread_mutex_lock(&handle->command_lock);
+    int r = LIBMK_SUCCESS;
+    if (handle->handle == NULL && handle->device != NULL) {
+        // A device that could not be recovered has nothing to release
+        if (handle->ack_policy == LIBMK_ACK_DEFERRED)
+            libmk_stop_event_thread();
+        handle->ack_policy = LIBMK_ACK_ALL;
+        handle->open = false;
+    } else {
+        // Outstanding responses must be read before the interface is
+        // released
+        r = libmk_set_ack_policy(handle, LIBMK_ACK_ALL);
+        if (r == LIBMK_SUCCESS)
+            r = libmk_set_control_mode(handle, LIBMK_FIRMWARE_CTRL);
+        if (r == LIBMK_SUCCESS)
+            r = handle->transport->release_interface(handle);
+        if (r == LIBMK_SUCCESS) {
+            if (reset) {
+                // The device must be reset while the handle is still valid
+                handle->transport->reset(handle);
+            }
+            handle->transport->close(handle);
+            handle->open = false;
+        }
     }
-
-    // Claim the interface on the device
-    r = libusb_claim_interface(handle->handle, LIBMK_IFACE_NUM);
-    if (r < 0)
-        return LIBMK_ERR_IFACE_CLAIM_FAILED;
-    return LIBMK_SUCCESS;
+    pthread_mutex_unlock(&handle->command_lock);
+    if (r == LIBMK_SUCCESS && handle == DeviceHandle) {
+        libmk_free_handle(handle);
+        DeviceHandle = NULL;
+    }
+    return r;
 }
 
 
-int libmk_set_effect(LibMK_Handle* handle, LibMK_Effect effect) {
+int libmk_lock_handle(LibMK_Handle* handle) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-
-    unsigned char* packet = libmk_build_packet(
-        2, 0x41, 0x01);
-    int r = libmk_send_packet(handle, packet);
-    if (r != LIBMK_SUCCESS)
-        return r;
-    packet = libmk_build_packet(
-        5, HEADER_SET, OPCODE_EFFECT, 0x00, 0x00, (unsigned char) effect);
-    return libmk_send_packet(handle, packet);
+    pthread_mutex_lock(&handle->command_lock);
+    handle->locks++;
+    return LIBMK_SUCCESS;
 }
 
 
-int libmk_set_full_color(LibMK_Handle* handle,
-                         unsigned char r,
-                         unsigned char g,
-                         unsigned char b) {
+int libmk_unlock_handle(LibMK_Handle* handle) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    unsigned char* packet = libmk_build_packet(
-        7, HEADER_FULL_COLOR, 0x00, 0x00, 0x00, r, g, b);
-    return libmk_send_packet(handle, packet);
+    handle->locks--;
+    pthread_mutex_unlock(&handle->command_lock);
+    return LIBMK_SUCCESS;
 }
 
 
-int libmk_send_packet(LibMK_Handle* handle, unsigned char* packet) {
-    return libmk_send_recv_packet(handle, packet, true);
+bool libmk_holds_handle(LibMK_Handle* handle) {
+    // The lock is reentrant, so only fails if another thread holds it
+    if (pthread_mutex_trylock(&handle->command_lock) != 0)
+        return false;
+    bool held = handle->locks > 0;
+    pthread_mutex_unlock(&handle->command_lock);
+    return held;
+}
+
+
+int libmk_usb_release_interface(LibMK_Handle* handle) {
+    if (libusb_release_interface(handle->handle, LIBMK_IFACE_NUM) < 0)
+        return LIBMK_ERR_IFACE_RELEASE_FAILED;
+    // Give the interface back to the driver it was taken from
+    if (handle->detached) {
+        handle->detached = false;
+        if (libusb_attach_kernel_driver(handle->handle, LIBMK_IFACE_NUM) < 0)
+            return LIBMK_ERR_KERNEL_DRIVER;
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_usb_reset(LibMK_Handle* handle) {
+    if (libusb_reset_device(handle->handle) != LIBUSB_SUCCESS)
+        return LIBMK_ERR_DEV_RESET_FAILED;
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_usb_close(LibMK_Handle* handle) {
+    // Transfers left in flight by LIBMK_ACK_DEFERRED must complete first
+    libmk_drain_pipeline(handle);
+    libusb_close(handle->handle);
+}
+
+
+int libmk_claim_interface(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    return handle->transport->claim_interface(handle);
+}
+
+
+int libmk_usb_claim_interface(LibMK_Handle* handle) {
+    int r;
+
+    // Unload the kernel driver for the device if it is active
+    if (libusb_kernel_driver_active(handle->handle, LIBMK_IFACE_NUM)) {
+        r = libusb_detach_kernel_driver(handle->handle, LIBMK_IFACE_NUM);
+        if (r < 0)
+            return LIBMK_ERR_KERNEL_DRIVER;
+        handle->detached = true;
+    }
+
+    // Claim the interface on the device
+    r = libusb_claim_interface(handle->handle, LIBMK_IFACE_NUM);
+    if (r < 0)
+        return LIBMK_ERR_IFACE_CLAIM_FAILED;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_set_effect(LibMK_Handle* handle, LibMK_Effect effect) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+
+    pthread_mutex_lock(&handle->command_lock);
+    // Re-activating the custom effect keeps the colors last sent
+    if (effect != LIBMK_EFF_CUSTOM)
+        handle->shadow_valid = false;
+    bool mode_set = handle->mode_valid && handle->mode == LIBMK_EFFECT_CTRL;
+    if (mode_set && handle->effect_valid && handle->effect == effect) {
+        pthread_mutex_unlock(&handle->command_lock);
+        return LIBMK_SUCCESS;
+    }
+
+    unsigned char* packets[2] = {
+        handle->buffers->command[0], handle->buffers->command[1]};
+    int n = 0;
+    if (!mode_set)
+        libmk_encode_control_mode(packets[n++], LIBMK_EFFECT_CTRL);
+    libmk_encode_effect(packets[n++], effect);
+    int r = libmk_send_packets(handle, packets, n, true, false);
+    // Upon failure it is unknown which packets the device has received
+    handle->mode = LIBMK_EFFECT_CTRL;
+    handle->effect = effect;
+    handle->mode_valid = handle->effect_valid = (r == LIBMK_SUCCESS);
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
+}
+
+
+int libmk_set_full_color(LibMK_Handle* handle,
+                         unsigned char r,
+                         unsigned char g,
+                         unsigned char b) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    handle->shadow_valid = false;
+    unsigned char* packet = handle->buffers->command[0];
+    libmk_encode_full_color(packet, r, g, b);
+    int result = libmk_send_packets(handle, &packet, 1, true, false);
+    if (result == LIBMK_SUCCESS)
+        libmk_confirm_cache(handle);
+    pthread_mutex_unlock(&handle->command_lock);
+    return result;
+}
+
+
+int libmk_send_packet(LibMK_Handle* handle, unsigned char* packet) {
+    return libmk_send_recv_packet(handle, packet, true);
 }
 
 
 int libmk_send_recv_packet(
         LibMK_Handle* handle, unsigned char* packet, bool response_required) {
+    int r = libmk_send_packets(handle, &packet, 1, response_required, false);
+    free(packet);
+    return r;
+}
+
+
+int libmk_exch_packet(LibMK_Handle* handle, unsigned char* packet) {
+    int r = libmk_send_packets(handle, &packet, 1, true, true);
+    if (r != LIBMK_SUCCESS)
+        free(packet);
+    return r;
+}
+
+
+int libmk_send_packets(LibMK_Handle* handle, unsigned char** packets,
+                       int n, bool response_required, bool exchange) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    // The pipeline serves a single batch of packets at a time
+    pthread_mutex_lock(&handle->command_lock);
+    // The response of an exchange is always awaited
+    LibMK_AckPolicy policy = exchange ? LIBMK_ACK_ALL : handle->ack_policy;
+    int r = LIBMK_ERR_TRANSFER;
+    // A device that could not be recovered is not opened
+    if (handle->handle != NULL || handle->device == NULL)
+        r = handle->transport->send_packets(
+            handle, packets, n, response_required, exchange, policy);
+    if (r == LIBMK_ERR_TRANSFER && handle->recovery_attempts > 0 &&
+            !handle->recovering && libmk_recover(handle) == LIBMK_SUCCESS)
+        r = handle->transport->send_packets(
+            handle, packets, n, response_required, exchange, policy);
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
+}
+
+
+int libmk_set_recovery(
+        LibMK_Handle* handle, unsigned int attempts, unsigned int backoff) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    // Only a device found on a USB port can be found again
+    if (attempts > 0 && handle->device == NULL)
+        return LIBMK_ERR_UNSUPPORTED;
+    pthread_mutex_lock(&handle->command_lock);
+    handle->recovery_attempts = attempts;
+    handle->recovery_backoff = backoff;
+    pthread_mutex_unlock(&handle->command_lock);
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_recover(LibMK_Handle* handle) {
+    unsigned long start = libmk_time_us();
+    unsigned int backoff = handle->recovery_backoff;
+    int r = LIBMK_ERR_TRANSFER;
+    handle->recovering = true;
+    for (unsigned int i = 0; i < handle->recovery_attempts; i++) {
+        libmk_sleep_us(backoff);
+        backoff *= 2;
+        r = libmk_reopen(handle);
+        if (r == LIBMK_SUCCESS)
+            r = libmk_replay_state(handle);
+        if (r == LIBMK_SUCCESS)
+            break;
+    }
+    handle->recovering = false;
+    pthread_mutex_lock(&handle->pipeline_lock);
+    if (r == LIBMK_SUCCESS) {
+        handle->stats.recoveries++;
+        libmk_record_latency(
+            handle->stats.recovery_latency, libmk_time_us() - start);
+    } else
+        handle->stats.failed_recoveries++;
+    pthread_mutex_unlock(&handle->pipeline_lock);
+    return r;
+}
+
+
+int libmk_reopen(LibMK_Handle* handle) {
+    if (handle->handle != NULL) {
+        handle->transport->close(handle);
+        handle->handle = NULL;
+    }
+    libusb_device** devices;
+    ssize_t amount = libusb_get_device_list(Context, &devices);
+    if (amount < 0)
+        return LIBMK_ERR_DEV_LIST;
+
+    // The device may have been enumerated again with a new address
+    const LibMK_Device* record = handle->device;
+    int r = LIBMK_ERR_DEV_NOT_CONNECTED;
+    for (ssize_t i = 0; i < amount && r != LIBMK_SUCCESS; i++) {
+        struct libusb_device_descriptor descriptor;
+        unsigned char ports[LIBMK_MAX_PORTS];
+        if (libusb_get_device_descriptor(devices[i], &descriptor) < 0 ||
+                descriptor.idVendor != record->bVendor ||
+                descriptor.idProduct != record->bDevice ||
+                libusb_get_bus_number(devices[i]) != record->bus ||
+                libusb_get_port_numbers(
+                    devices[i], ports, LIBMK_MAX_PORTS) != record->num_ports ||
+                memcmp(ports, record->ports, record->num_ports) != 0)
+            continue;
+        r = libusb_open(devices[i], &handle->handle) == 0 ?
+            LIBMK_SUCCESS : LIBMK_ERR_DEV_OPEN_FAILED;
+    }
+    libusb_free_device_list(devices, 1);
+    if (r != LIBMK_SUCCESS) {
+        handle->handle = NULL;
+        return r;
+    }
+    r = handle->transport->claim_interface(handle);
+    if (r != LIBMK_SUCCESS) {
+        handle->transport->close(handle);
+        handle->handle = NULL;
+    }
+    return r;
+}
+
+
+int libmk_replay_state(LibMK_Handle* handle) {
+    unsigned char packets[LIBMK_COMMAND_PCK_NUM + LIBMK_ALL_LED_PCK_NUM]
+        [LIBMK_PACKET_SIZE];
+    unsigned char* batch[LIBMK_COMMAND_PCK_NUM + LIBMK_ALL_LED_PCK_NUM];
+    for (int i = 0; i < LIBMK_COMMAND_PCK_NUM + LIBMK_ALL_LED_PCK_NUM; i++)
+        batch[i] = packets[i];
+
+    // The frame can only be sent with the custom effect active
+    if (handle->shadow_valid) {
+        handle->mode = LIBMK_EFFECT_CTRL;
+        handle->effect = LIBMK_EFF_CUSTOM;
+        handle->mode_valid = handle->effect_valid = true;
+    }
+    if (!handle->mode_valid)
+        return LIBMK_SUCCESS;
+    libmk_encode_control_mode(packets[0], handle->mode);
+    int r = handle->transport->send_packets(
+        handle, batch, 1, false, false, LIBMK_ACK_ALL);
+    if (r != LIBMK_SUCCESS)
+        return r;
+
+    int n = 0;
+    if (handle->mode == LIBMK_EFFECT_CTRL && handle->effect_valid)
+        libmk_encode_effect(packets[n++], handle->effect);
+    for (short k = 0; handle->shadow_valid && k < LIBMK_ALL_LED_PCK_NUM; k++) {
+        libmk_encode_all_led(packets[n], (unsigned char) k);
+        memcpy(packets[n++] + 4, handle->shadow[k], sizeof(handle->shadow[k]));
+    }
+    if (n == 0)
+        return LIBMK_SUCCESS;
+    return handle->transport->send_packets(
+        handle, batch, n, true, false, LIBMK_ACK_ALL);
+}
+
+
+int libmk_flush(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    int r = handle->transport->send_packets(
+        handle, NULL, 0, true, false, LIBMK_ACK_ALL);
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
+}
+
+
+int libmk_set_ack_policy(LibMK_Handle* handle, LibMK_AckPolicy policy) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    int r = LIBMK_SUCCESS;
+    if (policy != handle->ack_policy) {
+        if (policy == LIBMK_ACK_DEFERRED)
+            r = libmk_start_event_thread();
+        else if (handle->ack_policy == LIBMK_ACK_DEFERRED) {
+            r = libmk_flush(handle);
+            libmk_stop_event_thread();
+        }
+        // The policy is unchanged if the event thread could not start
+        if (r == LIBMK_SUCCESS || policy != LIBMK_ACK_DEFERRED)
+            handle->ack_policy = policy;
+    }
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
+}
+
+
+int libmk_run_pipeline(LibMK_Handle* handle, unsigned char** packets,
+                       int n, bool response_required, bool exchange,
+                       LibMK_AckPolicy policy) {
+    LibMK_Pipeline* pipeline = &handle->pipeline;
+    struct timeval timeout = {0, LIBMK_PACKET_TIMEOUT * 1000};
+    pthread_mutex_lock(&handle->pipeline_lock);
+
+    // Errors of responses drained in the background are reported now
+    int deferred = pipeline->result;
+    pipeline->result = LIBMK_SUCCESS;
+    pipeline->failed = false;
+    pipeline->packets = packets;
+    pipeline->first = pipeline->submitted;
+    unsigned int end = pipeline->first + n;
+    bool done;
+
+    while (true) {
+        // Fill the pipeline while no error has occurred. Unless all
+        // responses are awaited, the packets are only limited by the
+        // OUT transfers and the number of unanswered packets.
+        while (pipeline->result == LIBMK_SUCCESS && pipeline->submitted != end &&
+               pipeline->submitted - pipeline->sent < LIBMK_PIPELINE_DEPTH &&
+               pipeline->submitted - pipeline->received < (
+                   policy == LIBMK_ACK_ALL ?
+                   LIBMK_PIPELINE_DEPTH : LIBMK_ACK_QUEUE))
+            if (libmk_submit_packet(handle, pipeline->submitted - pipeline->first,
+                                    n, response_required, exchange,
+                                    policy) != LIBMK_SUCCESS)
+                break;
+        libmk_read_responses(handle);
+
+        if (pipeline->failed)
+            // Transfers may only be released when all of them completed
+            done = pipeline->sent == pipeline->submitted &&
+                   pipeline->received == pipeline->reading;
+        else if (pipeline->result != LIBMK_SUCCESS)
+            // The device still answers the packets it has received, so
+            // those responses are read to keep the next batch in step
+            done = pipeline->sent == pipeline->submitted && (
+                policy == LIBMK_ACK_DEFERRED ||
+                pipeline->received == pipeline->submitted);
+        else
+            done = pipeline->sent == end && (
+                policy == LIBMK_ACK_DEFERRED || pipeline->received == end);
+        if (done)
+            break;
+        if (pipeline->failed && !pipeline->cancelled)
+            libmk_cancel_pipeline(handle);
+        pipeline->progress = 0;
+        pthread_mutex_unlock(&handle->pipeline_lock);
+        libusb_handle_events_timeout_completed(
+            Context, &timeout, &pipeline->progress);
+        pthread_mutex_lock(&handle->pipeline_lock);
+    }
+
+    if (pipeline->failed) {
+        // Responses to packets that have not been read are abandoned
+        pipeline->reading = pipeline->submitted;
+        pipeline->received = pipeline->submitted;
+        pipeline->cancelled = false;
+        pipeline->failed = false;
+    }
+    int result = deferred != LIBMK_SUCCESS ? deferred : pipeline->result;
+    pipeline->result = LIBMK_SUCCESS;
+    pipeline->packets = NULL;
+    pthread_mutex_unlock(&handle->pipeline_lock);
+    return result;
+}
+
+
+int libmk_submit_packet(LibMK_Handle* handle, int index, int n,
+                        bool response_required, bool exchange,
+                        LibMK_AckPolicy policy) {
+    LibMK_Pipeline* pipeline = &handle->pipeline;
+    int slot = pipeline->submitted % LIBMK_PIPELINE_DEPTH;
+    int entry = pipeline->submitted % LIBMK_ACK_QUEUE;
+    // With LIBMK_ACK_LAST only the last response of the batch matters
+    bool last = policy != LIBMK_ACK_LAST || index == n - 1;
+    pipeline->targets[entry] = exchange ? pipeline->packets[index] : NULL;
+    pipeline->checked[entry] = last && !exchange;
+    pipeline->required[entry] = last && (response_required || exchange);
+    pipeline->times[entry] = libmk_time_us();
+    libusb_fill_interrupt_transfer(
+        handle->out[slot], handle->handle, LIBMK_EP_OUT | LIBUSB_ENDPOINT_OUT,
+        pipeline->packets[index], LIBMK_PACKET_SIZE,
+        libmk_out_callback, handle, LIBMK_PACKET_TIMEOUT);
+    if (libusb_submit_transfer(handle->out[slot]) != LIBUSB_SUCCESS) {
+        libmk_fail_pipeline(pipeline, LIBMK_ERR_TRANSFER);
+        return LIBMK_ERR_TRANSFER;
+    }
+#ifdef LIBMK_DEBUG
+    libmk_print_packet(pipeline->packets[index], "Sent");
+#endif // LIBMK_DEBUG
+    pipeline->submitted++;
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_read_responses(LibMK_Handle* handle) {
+    LibMK_Pipeline* pipeline = &handle->pipeline;
+    while (!pipeline->cancelled && pipeline->reading != pipeline->submitted &&
+           pipeline->reading - pipeline->received < LIBMK_PIPELINE_DEPTH) {
+        int slot = pipeline->reading % LIBMK_PIPELINE_DEPTH;
+        libusb_fill_interrupt_transfer(
+            handle->in[slot], handle->handle, LIBMK_EP_IN | LIBUSB_ENDPOINT_IN,
+            handle->buffers->responses[slot], LIBMK_PACKET_SIZE,
+            libmk_in_callback, handle, LIBMK_PACKET_TIMEOUT);
+        if (libusb_submit_transfer(handle->in[slot]) != LIBUSB_SUCCESS) {
+            // No response will be received for this packet
+            libmk_fail_pipeline(pipeline, LIBMK_ERR_TRANSFER);
+            pipeline->received++;
+        }
+        pipeline->reading++;
+    }
+}
+
+
+void libmk_fail_pipeline(LibMK_Pipeline* pipeline, int result) {
+    if (pipeline->result == LIBMK_SUCCESS)
+        pipeline->result = result;
+    if (result == LIBMK_ERR_TRANSFER)
+        pipeline->failed = true;
+}
+
+
+void libmk_cancel_pipeline(LibMK_Handle* handle) {
+    LibMK_Pipeline* pipeline = &handle->pipeline;
+    for (unsigned int i = pipeline->sent; i != pipeline->submitted; i++)
+        libusb_cancel_transfer(handle->out[i % LIBMK_PIPELINE_DEPTH]);
+    for (unsigned int i = pipeline->received; i != pipeline->reading; i++)
+        libusb_cancel_transfer(handle->in[i % LIBMK_PIPELINE_DEPTH]);
+    pipeline->cancelled = true;
+}
+
+
+void libmk_drain_pipeline(LibMK_Handle* handle) {
+    LibMK_Pipeline* pipeline = &handle->pipeline;
+    struct timeval timeout = {0, LIBMK_PACKET_TIMEOUT * 1000};
+    pthread_mutex_lock(&handle->pipeline_lock);
+    libmk_cancel_pipeline(handle);
+    // Cancelled transfers still complete through their callbacks
+    while (pipeline->sent != pipeline->submitted ||
+           pipeline->received != pipeline->reading) {
+        pipeline->progress = 0;
+        pthread_mutex_unlock(&handle->pipeline_lock);
+        libusb_handle_events_timeout_completed(
+            Context, &timeout, &pipeline->progress);
+        pthread_mutex_lock(&handle->pipeline_lock);
+    }
+    // Responses of the closed device are never read
+    memset(pipeline, 0, sizeof(LibMK_Pipeline));
+    for (int i = 0; i < LIBMK_PIPELINE_DEPTH; i++) {
+        handle->out[i]->dev_handle = NULL;
+        handle->in[i]->dev_handle = NULL;
+    }
+    pthread_mutex_unlock(&handle->pipeline_lock);
+}
+
+
+void libmk_out_callback(struct libusb_transfer* transfer) {
+    LibMK_Handle* handle = (LibMK_Handle*) transfer->user_data;
+    LibMK_Pipeline* pipeline = &handle->pipeline;
+    pthread_mutex_lock(&handle->pipeline_lock);
+    int entry = pipeline->sent++ % LIBMK_ACK_QUEUE;
+    pipeline->progress = 1;
+    if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+        handle->stats.timeouts++;
+    handle->stats.bytes_sent += transfer->actual_length;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        // The latency of the response is measured from this moment on
+        unsigned long now = libmk_time_us();
+        libmk_record_latency(
+            handle->stats.out_latency, now - pipeline->times[entry]);
+        pipeline->times[entry] = now;
+        handle->stats.packets_sent++;
+    }
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED && (
+            transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+            transfer->actual_length != LIBMK_PACKET_SIZE))
+        libmk_fail_pipeline(pipeline, LIBMK_ERR_TRANSFER);
+    pthread_mutex_unlock(&handle->pipeline_lock);
+}
+
+
+void libmk_in_callback(struct libusb_transfer* transfer) {
+    LibMK_Handle* handle = (LibMK_Handle*) transfer->user_data;
+    LibMK_Pipeline* pipeline = &handle->pipeline;
+    pthread_mutex_lock(&handle->pipeline_lock);
+    // IN transfers complete in order, so this is the response to the
+    // oldest packet that has not been answered yet
+    int entry = pipeline->received++ % LIBMK_ACK_QUEUE;
+    pipeline->progress = 1;
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+        pthread_mutex_unlock(&handle->pipeline_lock);
+        return;
+    }
+#ifdef LIBMK_DEBUG
+    libmk_print_packet(transfer->buffer, "Response");
+#endif // LIBMK_DEBUG
+    if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+        handle->stats.timeouts++;
+    handle->stats.bytes_received += transfer->actual_length;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        libmk_record_latency(handle->stats.in_latency,
+                             libmk_time_us() - pipeline->times[entry]);
+        handle->stats.responses++;
+        if (transfer->actual_length > 0 && transfer->buffer[0] == HEADER_ERROR)
+            handle->stats.protocol_errors++;
+    }
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+            transfer->actual_length != LIBMK_PACKET_SIZE) {
+        if (pipeline->required[entry])
+            libmk_fail_pipeline(pipeline, LIBMK_ERR_TRANSFER);
+    } else if (pipeline->targets[entry] != NULL) {
+        memcpy(pipeline->targets[entry], transfer->buffer, LIBMK_PACKET_SIZE);
+    } else if (pipeline->checked[entry] && transfer->buffer[0] == HEADER_ERROR) {
+        libmk_print_packet(transfer->buffer, "Error response");
+        libmk_fail_pipeline(pipeline, LIBMK_ERR_PROTOCOL);
+    }
+    // Keep reading while packets remain unanswered, also when no call
+    // is waiting for the responses
+    libmk_read_responses(handle);
+    pthread_mutex_unlock(&handle->pipeline_lock);
+}
+
+
+int libmk_start_event_thread(void) {
+    pthread_mutex_lock(&EventThreadLock);
+    if (EventThreadUsers == 0) {
+        pthread_mutex_lock(&EventExitLock);
+        EventThreadExit = false;
+        pthread_mutex_unlock(&EventExitLock);
+        if (pthread_create(
+                &EventThread, NULL, libmk_run_event_thread, NULL) != 0) {
+            pthread_mutex_unlock(&EventThreadLock);
+            return LIBMK_ERR_THREAD;
+        }
+    }
+    EventThreadUsers++;
+    pthread_mutex_unlock(&EventThreadLock);
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_stop_event_thread(void) {
+    pthread_mutex_lock(&EventThreadLock);
+    if (EventThreadUsers > 0 && --EventThreadUsers == 0) {
+        pthread_mutex_lock(&EventExitLock);
+        EventThreadExit = true;
+        pthread_mutex_unlock(&EventExitLock);
+        libusb_interrupt_event_handler(Context);
+        pthread_join(EventThread, NULL);
+    }
+    pthread_mutex_unlock(&EventThreadLock);
+}
+
+
+void* libmk_run_event_thread(void* arg) {
+    struct timeval timeout = {1, 0};
+    while (true) {
+        pthread_mutex_lock(&EventExitLock);
+        bool exit = EventThreadExit;
+        pthread_mutex_unlock(&EventExitLock);
+        if (exit)
+            break;
+        libusb_handle_events_timeout_completed(Context, &timeout, NULL);
+    }
+    return NULL;
+}
+
+
+unsigned char* libmk_build_packet(unsigned char predef, ...) {
+    unsigned char* packet = (unsigned char*)
+        malloc(LIBMK_PACKET_SIZE * sizeof(unsigned char));
+    if (packet == NULL)
+        return NULL;
+    for (int i = 0; i < LIBMK_PACKET_SIZE; i++)
+        packet[i] = 0x00;
+    va_list elements;
+    va_start(elements, predef);
+    int elem;
+    for (unsigned char i = 0; i < predef; i++) {
+        elem = va_arg(elements, int);
+        packet[i] = (unsigned char) elem;
+    }
+    va_end(elements);
+    return packet;
+}
+
+
+void libmk_encode_header(
+        unsigned char* packet, unsigned char header, unsigned char opcode) {
+    memset(packet, 0x00, LIBMK_PACKET_SIZE);
+    packet[0] = header;
+    packet[1] = opcode;
+}
+
+
+void libmk_encode_control_mode(unsigned char* packet, LibMK_ControlMode mode) {
+    libmk_encode_header(packet, HEADER_CONTROL, (unsigned char) mode);
+}
+
+
+void libmk_encode_effect(unsigned char* packet, LibMK_Effect effect) {
+    libmk_encode_header(packet, HEADER_SET, OPCODE_EFFECT);
+    packet[4] = (unsigned char) effect;
+}
+
+
+void libmk_encode_effect_details(
+        unsigned char* packet, LibMK_Effect_Details* effect) {
+    libmk_encode_header(packet, HEADER_SET, OPCODE_EFFECT_ARGS);
+    packet[4] = (unsigned char) effect->effect;
+    packet[5] = effect->speed;
+    packet[6] = effect->direction;
+    packet[7] = effect->amount;
+    packet[8] = 0xFF;
+    packet[9] = 0xFF;
+    memcpy(packet + 10, effect->foreground, 3);
+    memcpy(packet + 13, effect->background, 3);
+    memset(packet + 16, 0xFF, LIBMK_PACKET_SIZE - 16);
+}
+
+
+void libmk_encode_full_color(
+        unsigned char* packet, unsigned char r, unsigned char g, unsigned char b) {
+    libmk_encode_header(packet, HEADER_FULL_COLOR, 0x00);
+    packet[4] = r;
+    packet[5] = g;
+    packet[6] = b;
+}
+
+
+void libmk_encode_single_led(
+        unsigned char* packet, unsigned char offset,
+        unsigned char r, unsigned char g, unsigned char b) {
+    libmk_encode_header(packet, HEADER_FULL_COLOR, OPCODE_SINGLE_LED);
+    packet[2] = 0x01;
+    packet[4] = offset;
+    packet[5] = r;
+    packet[6] = g;
+    packet[7] = b;
+}
+
+
+void libmk_encode_all_led(unsigned char* packet, unsigned char index) {
+    libmk_encode_header(packet, HEADER_SET, OPCODE_ALL_LED);
+    packet[2] = index * 2;
+}
+
+
+int libmk_reset(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    libmk_invalidate_state(handle);
+    int r = handle->transport->reset(handle);
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
+}
+
+
+int libmk_set_all_led_color(LibMK_Handle* handle, unsigned char* colors) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    if (handle->keymap == NULL)
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    pthread_mutex_lock(&handle->command_lock);
+    unsigned long start = libmk_time_us();
+    unsigned char* packets[LIBMK_ALL_LED_PCK_NUM];
+    unsigned char* changed[LIBMK_ALL_LED_PCK_NUM];
+
+    for (short i = 0; i < LIBMK_ALL_LED_PCK_NUM; i++) {
+        packets[i] = handle->buffers->frame[i];
+        libmk_encode_all_led(packets[i], (unsigned char) i);
+    }
+
+    // The frame buffers are contiguous, so the table addresses them all
+    unsigned char* frame = handle->buffers->frame[0];
+    const LibMK_Scatter* scatter = &handle->scatter;
+    for (unsigned short k = 0; k < scatter->num; k++)
+        memcpy(frame + scatter->dst[k], colors + scatter->src[k], 3);
+
+    int result;
+    // Only the packets that differ from the last frame are sent
+    int n = libmk_diff_frame(handle, packets, changed);
+    result = LIBMK_SUCCESS;
+    if (n > 0) {
+        result = libmk_set_effect(handle, LIBMK_EFF_CUSTOM);
+        if (result == LIBMK_SUCCESS)
+            result = libmk_send_packets(handle, changed, n, true, false);
+    }
+    // Upon failure it is unknown which packets the device has received
+    handle->shadow_valid = (result == LIBMK_SUCCESS);
+    for (short k = 0; result == LIBMK_SUCCESS && k < LIBMK_ALL_LED_PCK_NUM; k++)
+        memcpy(handle->shadow[k], packets[k] + 4, sizeof(handle->shadow[k]));
+    pthread_mutex_lock(&handle->pipeline_lock);
+    libmk_record_latency(handle->stats.frame_latency, libmk_time_us() - start);
+    pthread_mutex_unlock(&handle->pipeline_lock);
+    if (result == LIBMK_SUCCESS)
+        libmk_confirm_cache(handle);
+    pthread_mutex_unlock(&handle->command_lock);
+    return result;
+}
+
+
+int libmk_diff_frame(
+        LibMK_Handle* handle, unsigned char** packets, unsigned char** changed) {
+    int n = 0;
+    for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++) {
+        unsigned char* colors = packets[k] + 4;
+        unsigned char* shadow = handle->shadow[k];
+        if (!handle->shadow_valid) {
+            changed[n++] = packets[k];
+            continue;
+        }
+        // Snap keys with near-identical colors to the colors last sent
+        for (short i = 0; handle->tolerance > 0 && i < LIBMK_ALL_LED_PER_PCK; i++) {
+            bool near = true;
+            for (short o = 0; o < 3; o++)
+                near = near && abs(colors[i * 3 + o] - shadow[i * 3 + o])
+                               <= handle->tolerance;
+            if (near)
+                memcpy(colors + i * 3, shadow + i * 3, 3);
+        }
+        if (memcmp(colors, shadow, sizeof(handle->shadow[k])) != 0)
+            changed[n++] = packets[k];
+    }
+    return n;
+}
+
+
+int libmk_set_color_tolerance(LibMK_Handle* handle, unsigned char tolerance) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    handle->tolerance = tolerance;
+    pthread_mutex_unlock(&handle->command_lock);
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_invalidate_frame(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    handle->shadow_valid = false;
+    pthread_mutex_unlock(&handle->command_lock);
+    return LIBMK_SUCCESS;
+}
+
+
+inline void libmk_print_packet(unsigned char* packet, char* label) {
+#ifdef LIBMK_DEBUG
+    printf("Packet: %s\n", label);
+    for (unsigned char j = 0; j < LIBMK_PACKET_SIZE; j++) {
+        printf("%02x ", packet[j]);
+        if ((j + 1) % 16 == 0) {
+            printf("\n");
+        } else if ((j + 1) % 8 == 0)
+            printf(" ");
+    }
+#endif
+}
+
+
+int libmk_set_leds(LibMK_Handle* handle, const LibMK_KeyColor* keys, size_t n) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    int r = libmk_send_leds(handle, keys, n);
+    if (r == LIBMK_SUCCESS)
+        libmk_confirm_cache(handle);
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
+}
+
+
+int libmk_send_leds(LibMK_Handle* handle, const LibMK_KeyColor* keys, size_t n) {
+    // Keys not present in the layout are left out of the cost
+    bool affected[LIBMK_ALL_LED_PCK_NUM] = {false};
+    int singles = 0, frames = 0, result;
+    for (size_t k = 0; k < n; k++) {
+        unsigned char offset;
+        result = libmk_get_offset(&offset, handle, keys[k].row, keys[k].col);
+        if (result != LIBMK_SUCCESS)
+            return result;
+        if (offset == 0xFF)
+            continue;
+        if (!affected[offset / LIBMK_ALL_LED_PER_PCK])
+            frames++;
+        affected[offset / LIBMK_ALL_LED_PER_PCK] = true;
+        singles++;
+    }
+    if (singles == 0)
+        return LIBMK_SUCCESS;
+
+    // Every packet costs a round trip, including the mode switches
+    bool custom_ctrl = handle->mode_valid && handle->mode == LIBMK_CUSTOM_CTRL;
+    bool effect_ctrl = handle->mode_valid && handle->mode == LIBMK_EFFECT_CTRL;
+    bool custom_eff = effect_ctrl &&
+        handle->effect_valid && handle->effect == LIBMK_EFF_CUSTOM;
+    singles += custom_ctrl ? 0 : 1;
+    frames += custom_eff ? 0 : (effect_ctrl ? 1 : 2);
+    bool use_frame = handle->shadow_valid && frames < singles;
+
+    // The frame buffers are only used as scratch space
+    unsigned char* packets[LIBMK_ALL_LED_PCK_NUM];
+    unsigned char slots[LIBMK_ALL_LED_PCK_NUM];
+    int num = 0;
+    if (use_frame) {
+        for (short i = 0; i < LIBMK_ALL_LED_PCK_NUM; i++) {
+            if (!affected[i])
+                continue;
+            packets[num] = handle->buffers->frame[i];
+            libmk_encode_all_led(packets[num], (unsigned char) i);
+            memcpy(packets[num] + 4, handle->shadow[i], sizeof(handle->shadow[i]));
+            slots[i] = (unsigned char) num++;
+        }
+        result = libmk_set_effect(handle, LIBMK_EFF_CUSTOM);
+    } else
+        result = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+    if (result != LIBMK_SUCCESS)
+        return result;
+
+    for (size_t k = 0; k < n; k++) {
+        unsigned char offset;
+        libmk_get_offset(&offset, handle, keys[k].row, keys[k].col);
+        if (offset == 0xFF)
+            continue;
+        const unsigned char* color = keys[k].color;
+        if (use_frame) {
+            unsigned char* packet = packets[slots[offset / LIBMK_ALL_LED_PER_PCK]];
+            memcpy(packet + 4 + (offset % LIBMK_ALL_LED_PER_PCK) * 3, color, 3);
+            continue;
+        }
+        packets[num] = handle->buffers->frame[num];
+        libmk_encode_single_led(packets[num++], offset, color[0], color[1], color[2]);
+        if (num < LIBMK_ALL_LED_PCK_NUM)
+            continue;
+        result = libmk_send_packets(handle, packets, num, true, false);
+        num = 0;
+        if (result != LIBMK_SUCCESS)
+            break;
+    }
+    if (num > 0 && result == LIBMK_SUCCESS)
+        result = libmk_send_packets(handle, packets, num, true, false);
+
+    // Upon failure it is unknown which packets the device has received
+    if (result != LIBMK_SUCCESS) {
+        handle->shadow_valid = false;
+        return result;
+    }
+    for (size_t k = 0; k < n; k++) {
+        unsigned char offset;
+        libmk_get_offset(&offset, handle, keys[k].row, keys[k].col);
+        if (offset == 0xFF)
+            continue;
+        memcpy(handle->shadow[offset / LIBMK_ALL_LED_PER_PCK] +
+               (offset % LIBMK_ALL_LED_PER_PCK) * 3, keys[k].color, 3);
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_get_offset(
+        unsigned char* offset, LibMK_Handle* handle,
+        unsigned char row, unsigned char col) {
+    if (handle->keymap == NULL)
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    if (row >= LIBMK_MAX_ROWS || col >= LIBMK_MAX_COLS)
+        return LIBMK_ERR_INVALID_ARG;
+    *offset = handle->keymap->offsets[row][col];
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_get_key(
+        LibMK_Handle* handle, unsigned char offset,
+        unsigned char* row, unsigned char* col) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    const LibMK_KeyMap* map = handle->keymap;
+    if (map == NULL)
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    if (map->index[offset] == 0xFF)
+        return LIBMK_ERR_INVALID_ARG;
+    *row = map->keys[map->index[offset]].row;
+    *col = map->keys[map->index[offset]].col;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_build_scatter(LibMK_Handle* handle) {
+    LibMK_Scatter* scatter = &handle->scatter;
+    scatter->num = 0;
+    handle->keymap = libmk_find_keymap(
+        handle->bDevice, handle->layout, handle->size);
+    if (handle->keymap == NULL)
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    for (int k = 0; k < handle->keymap->num; k++) {
+        const LibMK_Key* key = &handle->keymap->keys[k];
+        int packet = key->offset / LIBMK_ALL_LED_PER_PCK;
+        int index = key->offset % LIBMK_ALL_LED_PER_PCK;
+        scatter->src[scatter->num] = (key->row * LIBMK_MAX_COLS + key->col) * 3;
+        scatter->dst[scatter->num] = (unsigned short) (
+            packet * LIBMK_PACKET_SIZE + 4 + index * 3);
+        scatter->num++;
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+const LibMK_KeyMap* libmk_find_keymap(
+        int bDevice, LibMK_Layout layout, LibMK_Size size) {
+    pthread_once(&KeyMapsOnce, libmk_init_keymaps);
+    pthread_mutex_lock(&KeyMapsLock);
+    const LibMK_KeyMap* found = NULL;
+    for (const LibMK_KeyMap* map = KeyMaps; map != NULL; map = map->next) {
+        if (map->layout != layout || map->size != size)
+            continue;
+        if (map->bDevice == bDevice) {
+            found = map;
+            break;
+        }
+        if (map->bDevice == 0 && found == NULL)
+            found = map;
+    }
+    pthread_mutex_unlock(&KeyMapsLock);
+    return found;
+}
+
+
+int libmk_index_keymap(LibMK_KeyMap* map) {
+    memset(map->offsets, 0xFF, sizeof(map->offsets));
+    memset(map->index, 0xFF, sizeof(map->index));
+    if (map->num > LIBMK_MAX_ROWS * LIBMK_MAX_COLS)
+        return LIBMK_ERR_INVALID_ARG;
+    for (int k = 0; k < map->num; k++) {
+        const LibMK_Key* key = &map->keys[k];
+        // Offsets beyond the frame packets cannot be addressed
+        if (key->row >= LIBMK_MAX_ROWS || key->col >= LIBMK_MAX_COLS ||
+                key->offset >= LIBMK_ALL_LED_PCK_NUM * LIBMK_ALL_LED_PER_PCK)
+            return LIBMK_ERR_INVALID_ARG;
+        map->offsets[key->row][key->col] = key->offset;
+        // Keys sharing an LED are found by the first of them
+        if (map->index[key->offset] == 0xFF)
+            map->index[key->offset] = (unsigned char) k;
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_init_keymaps(void) {
+    int n = sizeof(BuiltinKeyMaps) / sizeof(LibMK_KeyMap);
+    pthread_mutex_lock(&KeyMapsLock);
+    for (int i = n - 1; i >= 0; i--) {
+        libmk_index_keymap(&BuiltinKeyMaps[i]);
+        BuiltinKeyMaps[i].next = KeyMaps;
+        KeyMaps = &BuiltinKeyMaps[i];
+    }
+    pthread_mutex_unlock(&KeyMapsLock);
+}
+
+
+void libmk_clear_keymaps(void) {
+    pthread_mutex_lock(&KeyMapsLock);
+    LibMK_KeyMap** prev = &KeyMaps;
+    while (*prev != NULL) {
+        LibMK_KeyMap* map = *prev;
+        if (map >= BuiltinKeyMaps &&
+                map < BuiltinKeyMaps + sizeof(BuiltinKeyMaps) / sizeof(LibMK_KeyMap)) {
+            prev = &map->next;
+            continue;
+        }
+        *prev = map->next;
+        if (map->mapping != NULL)
+            munmap(map->mapping, map->length);
+        free(map);
+    }
+    pthread_mutex_unlock(&KeyMapsLock);
+}
+
+
+int libmk_load_layouts(const char* path) {
+    pthread_once(&KeyMapsOnce, libmk_init_keymaps);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return LIBMK_ERR_FILE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(LibMK_LayoutsHeader)) {
+        close(fd);
+        return LIBMK_ERR_FILE;
+    }
+    size_t length = (size_t) st.st_size;
+    unsigned char* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return LIBMK_ERR_FILE;
+
+    const LibMK_LayoutsHeader* header = (const LibMK_LayoutsHeader*) data;
+    if (memcmp(header->magic, LIBMK_LAYOUTS_MAGIC, 4) != 0 ||
+            header->version != LIBMK_LAYOUTS_VERSION) {
+        munmap(data, length);
+        return LIBMK_ERR_FILE;
+    }
+    // The maps are only added once the whole file has been validated
+    LibMK_KeyMap* maps = NULL;
+    LibMK_KeyMap** last = &maps;
+    size_t position = sizeof(LibMK_LayoutsHeader);
+    int r = LIBMK_SUCCESS;
+    for (unsigned int i = 0; i < header->num && r == LIBMK_SUCCESS; i++) {
+        const LibMK_LayoutRecord* record =
+            (const LibMK_LayoutRecord*) (data + position);
+        position += sizeof(LibMK_LayoutRecord);
+        if (position > length ||
+                position + record->num * sizeof(LibMK_Key) > length) {
+            r = LIBMK_ERR_FILE;
+            break;
+        }
+        LibMK_KeyMap* map = (LibMK_KeyMap*) malloc(sizeof(LibMK_KeyMap));
+        if (map == NULL) {
+            r = LIBMK_ERR_NO_MEMORY;
+            break;
+        }
+        map->bDevice = record->bDevice;
+        map->layout = (LibMK_Layout) record->layout;
+        map->size = (LibMK_Size) record->size;
+        map->keys = (const LibMK_Key*) (data + position);
+        map->num = record->num;
+        map->mapping = NULL;
+        map->length = 0;
+        map->next = NULL;
+        *last = map;
+        last = &map->next;
+        position += record->num * sizeof(LibMK_Key);
+        r = libmk_index_keymap(map);
+    }
+    if (r != LIBMK_SUCCESS || maps == NULL) {
+        while (maps != NULL) {
+            LibMK_KeyMap* next = maps->next;
+            free(maps);
+            maps = next;
+        }
+        munmap(data, length);
+        return r;
+    }
+    // The last map of the file owns the mapping
+    LibMK_KeyMap* owner = maps;
+    while (owner->next != NULL)
+        owner = owner->next;
+    owner->mapping = data;
+    owner->length = length;
+    pthread_mutex_lock(&KeyMapsLock);
+    *last = KeyMaps;
+    KeyMaps = maps;
+    pthread_mutex_unlock(&KeyMapsLock);
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_write_layout(
+        const char* path, int bDevice, LibMK_Layout layout, LibMK_Size size,
+        const LibMK_Key* keys, int num) {
+    if (num < 0 || num > LIBMK_MAX_ROWS * LIBMK_MAX_COLS)
+        return LIBMK_ERR_INVALID_ARG;
+    LibMK_LayoutsHeader header;
+    memcpy(header.magic, LIBMK_LAYOUTS_MAGIC, 4);
+    header.version = LIBMK_LAYOUTS_VERSION;
+    header.num = 1;
+    LibMK_LayoutRecord record;
+    record.bDevice = (unsigned short) bDevice;
+    record.layout = (unsigned char) layout;
+    record.size = (unsigned char) size;
+    record.num = (unsigned short) num;
+    record.reserved = 0;
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return LIBMK_ERR_FILE;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(&record, sizeof(record), 1, file) == 1 &&
+        fwrite(keys, sizeof(LibMK_Key), num, file) == (size_t) num;
+    if (fclose(file) != 0 || !written)
+        return LIBMK_ERR_FILE;
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_set_single_led(
+        LibMK_Handle* handle, unsigned char row, unsigned char col,
+        unsigned char r, unsigned char g, unsigned char b) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    unsigned char offset;
+    int result = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+    if (result == LIBMK_SUCCESS)
+        result = libmk_get_offset(&offset, handle, row, col);
+    if (result == LIBMK_SUCCESS) {
+        unsigned char* packet = handle->buffers->command[0];
+        libmk_encode_single_led(packet, offset, r, g, b);
+        result = libmk_send_packets(handle, &packet, 1, true, false);
+    }
+    if (result == LIBMK_SUCCESS && offset != 0xFF) {
+        // Keep the last frame sent up-to-date with the change of this key
+        unsigned char* shadow = handle->shadow[offset / LIBMK_ALL_LED_PER_PCK] +
+            (offset % LIBMK_ALL_LED_PER_PCK) * 3;
+        shadow[0] = r;
+        shadow[1] = g;
+        shadow[2] = b;
+    }
+    if (result == LIBMK_SUCCESS)
+        libmk_confirm_cache(handle);
+    pthread_mutex_unlock(&handle->command_lock);
+    return result;
+}
+
+
+int libmk_set_effect_details(
+    LibMK_Handle* handle, LibMK_Effect_Details* effect) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    handle->shadow_valid = false;
+    int r = libmk_set_effect(handle, effect->effect);
+    if (r == LIBMK_SUCCESS) {
+        unsigned char* packet = handle->buffers->command[0];
+        libmk_encode_effect_details(packet, effect);
+        r = libmk_send_packets(handle, &packet, 1, true, false);
+    }
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
+}
+
+
+int libmk_get_firmware_version(LibMK_Handle* handle, LibMK_Firmware** fw) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    unsigned char* p = handle->buffers->command[0];
+    libmk_encode_header(p, 0x01, 0x02);
+    int r = libmk_send_packets(handle, &p, 1, true, true);
+    if (r == LIBMK_SUCCESS) {
+        (*fw) = (LibMK_Firmware*) malloc(sizeof(LibMK_Firmware));
+        for (unsigned char i=0; i<5; i++)
+            (*fw)->string[i] = p[0x04 + i];
+        (*fw)->string[5] = 0x00;
+        (*fw)->major = p[0x04] & 0x0F;
+        (*fw)->minor = p[0x06] & 0x0F;
+        (*fw)->patch = p[0x08] & 0x0F;
+        (*fw)->layout = p[0x04] & 0x0F;
+    }
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
+}
+
+
+int libmk_save_profile(LibMK_Handle* handle) {
+     if (handle == NULL)
+         handle = DeviceHandle;
+     if (handle == NULL)
+         return LIBMK_ERR_DEV_NOT_SET;
+     pthread_mutex_lock(&handle->command_lock);
+     int r = libmk_set_control_mode(handle, LIBMK_PROFILE_CTRL);
+     if (r == LIBMK_SUCCESS) {
+         unsigned char* p = handle->buffers->command[0];
+         libmk_encode_header(p, 0x50, 0x55);
+         r = libmk_send_packets(handle, &p, 1, false, false);
+     }
+     if (r == LIBMK_SUCCESS)
+         r = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+     pthread_mutex_unlock(&handle->command_lock);
+     return r;
+}
+
+
+int libmk_set_active_profile(LibMK_Handle* handle, char profile) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    int t, result;
-    int r = libusb_interrupt_transfer(
-        handle->handle, LIBMK_EP_OUT | LIBUSB_ENDPOINT_OUT,
-        packet, LIBMK_PACKET_SIZE, &t,
-        LIBMK_PACKET_TIMEOUT);
-#ifdef LIBMK_DEBUG
-    libmk_print_packet(packet, "Sent");
-#endif // LIBMK_DEBUG
-    free(packet);
-    if (r != 0 || t != LIBMK_PACKET_SIZE)
-        return LIBMK_ERR_TRANSFER;
-    packet = libmk_build_packet(0);
-    r = libusb_interrupt_transfer(
-            handle->handle, LIBMK_EP_IN | LIBUSB_ENDPOINT_IN,
-            packet, LIBMK_PACKET_SIZE, &t, LIBMK_PACKET_TIMEOUT);
-#ifdef LIBMK_DEBUG
-    libmk_print_packet(packet, "Response");
-#endif // LIBMK_DEBUG
-    if (r != LIBUSB_SUCCESS && response_required) {
-        result = LIBMK_ERR_TRANSFER;
-    } else if (t != LIBMK_PACKET_SIZE && response_required) {
-        result = LIBMK_ERR_TRANSFER;
-    } else if (packet[0] == HEADER_ERROR) {
-        libmk_print_packet(packet, "Error response");
-        result = LIBMK_ERR_PROTOCOL;
-    } else
-        result = LIBMK_SUCCESS;
-    free(packet);
-    return result;
+    pthread_mutex_lock(&handle->command_lock);
+    int r = libmk_set_control_mode(handle, LIBMK_PROFILE_CTRL);
+    if (r == LIBMK_SUCCESS && !(1 <= profile <= 4))
+        r = LIBMK_ERR_INVALID_ARG;
+    if (r == LIBMK_SUCCESS) {
+        unsigned char* p = handle->buffers->command[0];
+        libmk_encode_header(p, HEADER_SET, 0x00);
+        p[4] = (unsigned char) profile;
+        r = libmk_send_packets(handle, &p, 1, true, false);
+        // The new profile brings along its own lighting settings
+        handle->effect_valid = false;
+    }
+    if (r == LIBMK_SUCCESS)
+        r = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
 }
 
 
-int libmk_exch_packet(LibMK_Handle* handle, unsigned char* packet) {
-    int t;
-    int r = libusb_interrupt_transfer(
-        handle->handle, LIBMK_EP_OUT | LIBUSB_ENDPOINT_OUT,
-        packet, LIBMK_PACKET_SIZE, &t, LIBMK_PACKET_TIMEOUT);
-#ifdef LIBMK_DEBUG
-    libmk_print_packet(packet, "Sent");
-#endif // LIBMK_DEBUG
-    if (r != LIBUSB_SUCCESS || t != LIBMK_PACKET_SIZE) {
-        free(packet);
-        return LIBMK_ERR_TRANSFER;
-    }
-    r = libusb_interrupt_transfer(
-        handle->handle, LIBMK_EP_IN | LIBUSB_ENDPOINT_IN,
-        packet, LIBMK_PACKET_SIZE, &t, LIBMK_PACKET_TIMEOUT);
-#ifdef LIBMK_DEBUG
-    libmk_print_packet(packet, "Received");
-#endif // LIBMK_DEBUG
-    if (r != LIBUSB_SUCCESS || t != LIBMK_PACKET_SIZE)
-        return LIBMK_ERR_TRANSFER;
-    return LIBMK_SUCCESS;
+int libmk_get_active_profile(LibMK_Handle* handle, char* profile) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    unsigned char* p = handle->buffers->command[0];
+    libmk_encode_header(p, HEADER_GET, 0x00);
+    int r = libmk_send_packets(handle, &p, 1, true, true);
+    if (r == LIBMK_SUCCESS)
+        *profile = p[4];
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
 }
 
 
-unsigned char* libmk_build_packet(unsigned char predef, ...) {
-    unsigned char* packet = (unsigned char*)
-        malloc(LIBMK_PACKET_SIZE * sizeof(unsigned char));
-    if (packet == NULL)
-        return NULL;
-    for (int i = 0; i < LIBMK_PACKET_SIZE; i++)
-        packet[i] = 0x00;
-    va_list elements;
-    va_start(elements, predef);
-    int elem;
-    for (unsigned char i = 0; i < predef; i++) {
-        elem = va_arg(elements, int);
-        packet[i] = (unsigned char) elem;
+int libmk_set_control_mode(LibMK_Handle* handle, LibMK_ControlMode mode) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->command_lock);
+    if (mode != LIBMK_CUSTOM_CTRL)
+        handle->shadow_valid = false;
+    if (handle->mode_valid && handle->mode == mode) {
+        pthread_mutex_unlock(&handle->command_lock);
+        return LIBMK_SUCCESS;
     }
-    va_end(elements);
-    return packet;
+    unsigned char* p = handle->buffers->command[0];
+    libmk_encode_control_mode(p, mode);
+    int r = libmk_send_packets(handle, &p, 1, false, false);
+    // Changing the control mode may change the active effect
+    handle->mode = mode;
+    handle->mode_valid = (r == LIBMK_SUCCESS);
+    handle->effect_valid = false;
+    pthread_mutex_unlock(&handle->command_lock);
+    return r;
 }
 
 
-int libmk_reset(LibMK_Handle* handle) {
+int libmk_invalidate_state(LibMK_Handle* handle) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    int r = libusb_reset_device(handle->handle);
-    if (r != LIBUSB_SUCCESS)
-        return LIBMK_ERR_DEV_RESET_FAILED;
+    pthread_mutex_lock(&handle->command_lock);
+    handle->mode_valid = false;
+    handle->effect_valid = false;
+    handle->shadow_valid = false;
+    pthread_mutex_unlock(&handle->command_lock);
     return LIBMK_SUCCESS;
 }
 
 
-int libmk_set_all_led_color(LibMK_Handle* handle, unsigned char* colors) {
+int libmk_start_presenter(LibMK_Handle* handle, unsigned int rate) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    libmk_set_effect(handle, LIBMK_EFF_CUSTOM);
-    unsigned char* packets[LIBMK_ALL_LED_PCK_NUM];
+    if (rate == 0)
+        return LIBMK_ERR_INVALID_ARG;
+    pthread_mutex_lock(&handle->presenter_lock);
+    if (handle->presenter != NULL) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_STILL_ACTIVE;
+    }
 
-    for (short i = 0; i < LIBMK_ALL_LED_PCK_NUM; i++)
-        packets[i] = libmk_build_packet(3, HEADER_SET, 0xA8, (unsigned char) i * 2);
+    LibMK_Presenter* presenter = (LibMK_Presenter*) malloc(sizeof(LibMK_Presenter));
+    if (presenter == NULL) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_THREAD;
+    }
+    memset(presenter, 0, sizeof(LibMK_Presenter));
+    presenter->interval = 1000000000L / rate;
+    presenter->result = LIBMK_SUCCESS;
+    clock_gettime(CLOCK_MONOTONIC, &presenter->window);
+    pthread_mutex_init(&presenter->lock, NULL);
+    // The pacing must not be affected by changes of the system time
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&presenter->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    handle->presenter = presenter;
+    int r = LIBMK_SUCCESS;
+    if (pthread_create(&presenter->thread, NULL, libmk_run_presenter, handle) != 0) {
+        handle->presenter = NULL;
+        pthread_cond_destroy(&presenter->cond);
+        pthread_mutex_destroy(&presenter->lock);
+        free(presenter);
+        r = LIBMK_ERR_THREAD;
+    }
+    pthread_mutex_unlock(&handle->presenter_lock);
+    return r;
+}
 
-    unsigned char offset;
-    int packet, index, result;
 
-    for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
-        for (unsigned char c = 0; c < LIBMK_MAX_COLS; c++) {
-            result = libmk_get_offset(&offset, handle, r, c);
-            if (result != LIBMK_SUCCESS)
-                return result;
-            if (offset == 0xFF)
-                continue;
-            packet = offset / LIBMK_ALL_LED_PER_PCK;
-            index = offset % LIBMK_ALL_LED_PER_PCK;
-            for (short o = 0; o < 3; o++) {
-                packets[packet][4 + (index * 3) + o] = colors[
-                    (r * LIBMK_MAX_COLS + c) * 3 + o];
-            }
-        }
-        
-    for (short k = 0; k < LIBMK_ALL_LED_PCK_NUM; k++) {
-        int r = libmk_send_packet(handle, packets[k]);
-        if (r != LIBMK_SUCCESS)
-            return r;
+int libmk_stop_presenter(LibMK_Handle* handle) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    // Posting threads wait until the presenter has been freed
+    pthread_mutex_lock(&handle->presenter_lock);
+    LibMK_Presenter* presenter = handle->presenter;
+    if (presenter == NULL) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_NOT_RUNNING;
     }
-    return LIBMK_SUCCESS;
+    // The thread may be waiting for the lock of the calling thread
+    if (libmk_holds_handle(handle)) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_STILL_ACTIVE;
+    }
+    pthread_mutex_lock(&presenter->lock);
+    presenter->exit = true;
+    pthread_cond_signal(&presenter->cond);
+    pthread_mutex_unlock(&presenter->lock);
+    pthread_join(presenter->thread, NULL);
+
+    handle->presenter = NULL;
+    pthread_mutex_unlock(&handle->presenter_lock);
+    int result = presenter->result;
+    pthread_cond_destroy(&presenter->cond);
+    pthread_mutex_destroy(&presenter->lock);
+    free(presenter);
+    return result;
 }
 
 
-inline void libmk_print_packet(unsigned char* packet, char* label) {
-#ifdef LIBMK_DEBUG
-    printf("Packet: %s\n", label);
-    for (unsigned char j = 0; j < LIBMK_PACKET_SIZE; j++) {
-        printf("%02x ", packet[j]);
-        if ((j + 1) % 16 == 0) {
-            printf("\n");
-        } else if ((j + 1) % 8 == 0)
-            printf(" ");
+int libmk_post_frame(LibMK_Handle* handle, unsigned char* colors) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->presenter_lock);
+    LibMK_Presenter* presenter = handle->presenter;
+    if (presenter == NULL) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_NOT_RUNNING;
     }
-#endif
+    // The thread may be waiting for the lock of the calling thread
+    if (libmk_holds_handle(handle)) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_STILL_ACTIVE;
+    }
+    pthread_mutex_lock(&presenter->lock);
+    memcpy(presenter->frame, colors, sizeof(presenter->frame));
+    presenter->full = false;
+    presenter->pending = true;
+    presenter->posted++;
+    int result = presenter->result;
+    presenter->result = LIBMK_SUCCESS;
+    pthread_cond_signal(&presenter->cond);
+    pthread_mutex_unlock(&presenter->lock);
+    pthread_mutex_unlock(&handle->presenter_lock);
+    return result;
 }
 
 
-int libmk_get_offset(
-        unsigned char* offset, LibMK_Handle* handle,
-        unsigned char row, unsigned char col) {
-    if (handle->layout != LAYOUT_ISO && handle->layout != LAYOUT_ANSI)
-        return LIBMK_ERR_UNKNOWN_LAYOUT;
-    *offset = LIBMK_LAYOUT[handle->layout - 1][handle->size][row][col];
-    return LIBMK_SUCCESS;
+int libmk_post_full_color(
+        LibMK_Handle* handle, unsigned char r, unsigned char g, unsigned char b) {
+    if (handle == NULL)
+        handle = DeviceHandle;
+    if (handle == NULL)
+        return LIBMK_ERR_DEV_NOT_SET;
+    pthread_mutex_lock(&handle->presenter_lock);
+    LibMK_Presenter* presenter = handle->presenter;
+    if (presenter == NULL) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_NOT_RUNNING;
+    }
+    // The thread may be waiting for the lock of the calling thread
+    if (libmk_holds_handle(handle)) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_STILL_ACTIVE;
+    }
+    pthread_mutex_lock(&presenter->lock);
+    presenter->frame[0][0][0] = r;
+    presenter->frame[0][0][1] = g;
+    presenter->frame[0][0][2] = b;
+    presenter->full = true;
+    presenter->pending = true;
+    presenter->posted++;
+    int result = presenter->result;
+    presenter->result = LIBMK_SUCCESS;
+    pthread_cond_signal(&presenter->cond);
+    pthread_mutex_unlock(&presenter->lock);
+    pthread_mutex_unlock(&handle->presenter_lock);
+    return result;
 }
 
 
-int libmk_set_single_led(
-        LibMK_Handle* handle, unsigned char row, unsigned char col,
-        unsigned char r, unsigned char g, unsigned char b) {
+int libmk_get_presenter_fps(LibMK_Handle* handle, double* fps) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    int result = libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
-    if (result != LIBMK_SUCCESS)
-        return result;
-    unsigned char offset;
-    result = libmk_get_offset(&offset, handle, row, col);
-    if (result != LIBMK_SUCCESS)
-        return result;
-    unsigned char* packet = libmk_build_packet(
-        8, 0xC0, 0x01, 0x01, 0x00, offset, r, g, b);
-    return libmk_send_packet(handle, packet);
+    pthread_mutex_lock(&handle->presenter_lock);
+    LibMK_Presenter* presenter = handle->presenter;
+    if (presenter == NULL) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_NOT_RUNNING;
+    }
+    // The thread may be waiting for the lock of the calling thread
+    if (libmk_holds_handle(handle)) {
+        pthread_mutex_unlock(&handle->presenter_lock);
+        return LIBMK_ERR_STILL_ACTIVE;
+    }
+    pthread_mutex_lock(&presenter->lock);
+    *fps = presenter->fps;
+    pthread_mutex_unlock(&presenter->lock);
+    pthread_mutex_unlock(&handle->presenter_lock);
+    return LIBMK_SUCCESS;
 }
 
 
-int libmk_set_effect_details(
-    LibMK_Handle* handle, LibMK_Effect_Details* effect) {
+void* libmk_run_presenter(void* arg) {
+    LibMK_Handle* handle = (LibMK_Handle*) arg;
+    LibMK_Presenter* presenter = handle->presenter;
+    unsigned char frame[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    pthread_mutex_lock(&presenter->lock);
+    while (true) {
+        // Wait for a frame, and then for the start of the next interval.
+        // While no frames are posted, the rate is still measured.
+        while (!presenter->exit && !presenter->pending) {
+            struct timespec measure = presenter->window;
+            measure.tv_sec += 1;
+            pthread_cond_timedwait(&presenter->cond, &presenter->lock, &measure);
+            libmk_measure_presenter(presenter);
+        }
+        while (!presenter->exit && pthread_cond_timedwait(
+                &presenter->cond, &presenter->lock, &next) == 0);
+        if (presenter->exit)
+            break;
+
+        // Only the frame in the mailbox at this moment is sent
+        bool full = presenter->full;
+        memcpy(frame, presenter->frame, sizeof(frame));
+        presenter->pending = false;
+        pthread_mutex_unlock(&presenter->lock);
+
+        int result = full ?
+            libmk_set_full_color(handle, frame[0][0][0], frame[0][0][1], frame[0][0][2]) :
+            libmk_set_all_led_color(handle, (unsigned char*) frame);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&presenter->lock);
+        if (presenter->result == LIBMK_SUCCESS)
+            presenter->result = result;
+        presenter->presented++;
+        presenter->measured++;
+
+        // A frame that took longer than the interval delays the next one
+        next.tv_nsec += presenter->interval;
+        next.tv_sec += next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        if (next.tv_sec < now.tv_sec ||
+                (next.tv_sec == now.tv_sec && next.tv_nsec < now.tv_nsec))
+            next = now;
+        libmk_measure_presenter(presenter);
+    }
+    pthread_mutex_unlock(&presenter->lock);
+    return NULL;
+}
+
+
+void libmk_measure_presenter(LibMK_Presenter* presenter) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double) (now.tv_sec - presenter->window.tv_sec) +
+        (double) (now.tv_nsec - presenter->window.tv_nsec) / 1e9;
+    if (elapsed >= 1.0) {
+        presenter->fps = presenter->measured / elapsed;
+        presenter->measured = 0;
+        presenter->window = now;
+    }
+}
+
+
+int libmk_get_stats(LibMK_Handle* handle, LibMK_Stats* stats) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    unsigned char* packet = libmk_build_packet(
-        10, HEADER_SET, OPCODE_EFFECT_ARGS, 0x00, 0x00,
-        (unsigned char) effect->effect, effect->speed, effect->direction,
-        effect->amount, 0xFF, 0xFF);
-    unsigned char i;
-    for (i=0; i < 3; i++)
-        packet[10 + i] = effect->foreground[i];
-    for (i=0; i < 3; i++)
-        packet[13 + i] = effect->background[i];
-    for (i=16; i < 64; i++)
-        packet[i] = 0xFF;
-    int r = libmk_set_effect(handle, effect->effect);
-    if (r != LIBMK_SUCCESS)
-        return r;
-    return libmk_send_packet(handle, packet);
+    pthread_mutex_lock(&handle->pipeline_lock);
+    memcpy(stats, &handle->stats, sizeof(LibMK_Stats));
+    pthread_mutex_unlock(&handle->pipeline_lock);
+    return LIBMK_SUCCESS;
 }
 
 
-int libmk_get_firmware_version(LibMK_Handle* handle, LibMK_Firmware** fw) {
+int libmk_reset_stats(LibMK_Handle* handle) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    unsigned char* p = libmk_build_packet(2, 0x01, 0x02);
-    int r = libmk_exch_packet(handle, p);
-    if (r != LIBMK_SUCCESS)
-        return r;
-    (*fw) = (LibMK_Firmware*) malloc(sizeof(LibMK_Firmware));
-    for (unsigned char i=0; i<5; i++)
-        (*fw)->string[i] = p[0x04 + i];
-    (*fw)->string[5] = 0x00;
-    (*fw)->major = p[0x04] & 0x0F;
-    (*fw)->minor = p[0x06] & 0x0F;
-    (*fw)->patch = p[0x08] & 0x0F;
-    (*fw)->layout = p[0x04] & 0x0F;
+    pthread_mutex_lock(&handle->pipeline_lock);
+    memset(&handle->stats, 0, sizeof(LibMK_Stats));
+    pthread_mutex_unlock(&handle->pipeline_lock);
     return LIBMK_SUCCESS;
 }
 
 
-int libmk_save_profile(LibMK_Handle* handle) {
-     if (handle == NULL)
-         handle = DeviceHandle;
-     if (handle == NULL)
-         return LIBMK_ERR_DEV_NOT_SET;
-     int r = libmk_set_control_mode(handle, LIBMK_PROFILE_CTRL);
-     if (r != LIBMK_SUCCESS)
-         return r;
-     unsigned char* p = libmk_build_packet(2, 0x50, 0x55);
-     r = libmk_send_recv_packet(handle, p, false);
-     if (r != LIBMK_SUCCESS)
-         return r;
-     return libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+unsigned long libmk_time_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long) now.tv_sec * 1000000UL + now.tv_nsec / 1000;
 }
 
 
-int libmk_set_active_profile(LibMK_Handle* handle, char profile) {
-    if (handle == NULL)
-        handle = DeviceHandle;
+void libmk_record_latency(unsigned long* histogram, unsigned long latency) {
+    int bucket = 0;
+    while (latency >= 2 && bucket < LIBMK_LATENCY_BUCKETS - 1) {
+        latency >>= 1;
+        bucket++;
+    }
+    histogram[bucket]++;
+}
+
+
+int libmk_set_simulated_device(
+        LibMK_Model model, LibMK_Layout layout, LibMK_Handle** handle) {
     if (handle == NULL)
-        return LIBMK_ERR_DEV_NOT_SET;
-    int r = libmk_set_control_mode(handle, LIBMK_PROFILE_CTRL);
-    if (r != LIBMK_SUCCESS)
-        return r;
-    if (!(1 <= profile <= 4))
-        return LIBMK_ERR_INVALID_ARG;
-    unsigned char* p = libmk_build_packet(5, HEADER_SET, 0x00, 0x00, 0x00, profile);
-    r = libmk_send_packet(handle, p);
+        handle = &DeviceHandle;
+    int r = libmk_alloc_handle(handle, model);
     if (r != LIBMK_SUCCESS)
         return r;
-    return libmk_set_control_mode(handle, LIBMK_CUSTOM_CTRL);
+    if (libmk_find_keymap(0, layout, (*handle)->size) == NULL) {
+        libmk_free_handle(*handle);
+        *handle = NULL;
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    }
+    LibMK_Simulator* sim = (LibMK_Simulator*) malloc(sizeof(LibMK_Simulator));
+    if (sim == NULL) {
+        libmk_free_handle(*handle);
+        *handle = NULL;
+        return LIBMK_ERR_DEV_OPEN_FAILED;
+    }
+    memset(sim, 0, sizeof(LibMK_Simulator));
+    pthread_mutex_init(&sim->lock, NULL);
+    sim->layout = layout;
+    sim->mode = LIBMK_FIRMWARE_CTRL;
+    sim->effect = LIBMK_EFF_FULL;
+    sim->profile = 1;
+    (*handle)->simulator = sim;
+    (*handle)->transport = &LIBMK_SIM_TRANSPORT;
+    (*handle)->bVendor = LIBMK_VENDOR_ID;
+    (*handle)->open = true;
+    return LIBMK_SUCCESS;
 }
 
 
-int libmk_get_active_profile(LibMK_Handle* handle, char* profile) {
+int libmk_set_simulated_latency(LibMK_Handle* handle, unsigned int latency) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    unsigned char* p = libmk_build_packet(1, 0x52);
-    int r = libmk_exch_packet(handle, p);
-    if (r != LIBMK_SUCCESS)
-        return r;
-    *profile = p[4];
-    free(p);
+    if (handle->simulator == NULL)
+        return LIBMK_ERR_INVALID_DEV;
+    pthread_mutex_lock(&handle->simulator->lock);
+    handle->simulator->latency = latency;
+    pthread_mutex_unlock(&handle->simulator->lock);
     return LIBMK_SUCCESS;
 }
 
 
-int libmk_set_control_mode(LibMK_Handle* handle, LibMK_ControlMode mode) {
+int libmk_get_simulated_leds(LibMK_Handle* handle, unsigned char* colors) {
     if (handle == NULL)
         handle = DeviceHandle;
     if (handle == NULL)
         return LIBMK_ERR_DEV_NOT_SET;
-    char* p = libmk_build_packet(2, 0x41, mode);
-    return libmk_send_recv_packet(handle, p, false);
+    LibMK_Simulator* sim = handle->simulator;
+    if (sim == NULL)
+        return LIBMK_ERR_INVALID_DEV;
+    const LibMK_KeyMap* map = libmk_find_keymap(
+        handle->bDevice, sim->layout, handle->size);
+    pthread_mutex_lock(&sim->lock);
+    for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
+        for (unsigned char c = 0; c < LIBMK_MAX_COLS; c++) {
+            unsigned char* color = colors + (r * LIBMK_MAX_COLS + c) * 3;
+            unsigned char offset = map->offsets[r][c];
+            if (offset == 0xFF)
+                memset(color, 0x00, 3);
+            else
+                memcpy(color, sim->leds[offset], 3);
+        }
+    pthread_mutex_unlock(&sim->lock);
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_sim_send_packets(
+        LibMK_Handle* handle, unsigned char** packets, int n,
+        bool response_required, bool exchange, LibMK_AckPolicy policy) {
+    LibMK_Simulator* sim = handle->simulator;
+    unsigned char response[LIBMK_PACKET_SIZE];
+    int result = LIBMK_SUCCESS;
+    pthread_mutex_lock(&sim->lock);
+    unsigned int latency = sim->latency;
+    pthread_mutex_unlock(&sim->lock);
+
+    for (int i = 0; i < n; i++) {
+        unsigned long start = libmk_time_us();
+        libmk_sleep_us(latency);
+        pthread_mutex_lock(&sim->lock);
+        bool usable = sim->claimed && !sim->closed;
+        if (usable)
+            libmk_sim_process(sim, packets[i], response);
+        pthread_mutex_unlock(&sim->lock);
+        if (!usable)
+            return LIBMK_ERR_TRANSFER;
+        unsigned long sent = libmk_time_us();
+        // Unless all responses are awaited, they overlap with the packets
+        bool last = i == n - 1;
+        if (policy == LIBMK_ACK_ALL || exchange || last)
+            libmk_sleep_us(latency);
+
+        pthread_mutex_lock(&handle->pipeline_lock);
+        libmk_record_latency(handle->stats.out_latency, sent - start);
+        libmk_record_latency(handle->stats.in_latency, libmk_time_us() - sent);
+        handle->stats.packets_sent++;
+        handle->stats.responses++;
+        handle->stats.bytes_sent += LIBMK_PACKET_SIZE;
+        handle->stats.bytes_received += LIBMK_PACKET_SIZE;
+        if (response[0] == HEADER_ERROR)
+            handle->stats.protocol_errors++;
+        pthread_mutex_unlock(&handle->pipeline_lock);
+
+        if (exchange)
+            memcpy(packets[i], response, LIBMK_PACKET_SIZE);
+        else if ((policy != LIBMK_ACK_LAST || last) &&
+                 response[0] == HEADER_ERROR && result == LIBMK_SUCCESS)
+            result = LIBMK_ERR_PROTOCOL;
+    }
+    return result;
+}
+
+
+void libmk_sim_process(
+        LibMK_Simulator* sim, unsigned char* packet, unsigned char* response) {
+    // The keyboard answers with the packet, filled in where required
+    memcpy(response, packet, LIBMK_PACKET_SIZE);
+    unsigned char header = packet[0], opcode = packet[1];
+    bool valid = true;
+
+    if (header == HEADER_CONTROL && opcode <= LIBMK_PROFILE_CTRL)
+        sim->mode = (LibMK_ControlMode) opcode;
+    else if (header == HEADER_SET && opcode == OPCODE_EFFECT)
+        sim->effect = (LibMK_Effect) packet[4];
+    else if (header == HEADER_SET && opcode == OPCODE_EFFECT_ARGS)
+        memcpy(sim->details, packet, LIBMK_PACKET_SIZE);
+    else if (header == HEADER_SET && opcode == OPCODE_ALL_LED &&
+             packet[2] / 2 < LIBMK_ALL_LED_PCK_NUM)
+        memcpy(sim->leds[packet[2] / 2 * LIBMK_ALL_LED_PER_PCK], packet + 4,
+               LIBMK_ALL_LED_PER_PCK * 3);
+    else if (header == HEADER_FULL_COLOR && opcode == 0x00)
+        for (int i = 0; i < LIBMK_ALL_LED_PCK_NUM * LIBMK_ALL_LED_PER_PCK; i++)
+            memcpy(sim->leds[i], packet + 4, 3);
+    else if (header == HEADER_FULL_COLOR && opcode == OPCODE_SINGLE_LED &&
+             packet[4] < LIBMK_ALL_LED_PCK_NUM * LIBMK_ALL_LED_PER_PCK)
+        memcpy(sim->leds[packet[4]], packet + 5, 3);
+    else if (header == 0x01 && opcode == 0x02)
+        // The first digit of the version string is the layout
+        snprintf((char*) response + 4, 6, "%d.0.3", (int) sim->layout);
+    else if (header == HEADER_SET && opcode == 0x00 &&
+             packet[4] >= 1 && packet[4] <= 4)
+        sim->profile = (char) packet[4];
+    else if (header == HEADER_GET && opcode == 0x00)
+        response[4] = (unsigned char) sim->profile;
+    else if (header == 0x50 && opcode == 0x55)
+        sim->saved++;
+    else
+        valid = false;
+
+    if (!valid)
+        response[0] = HEADER_ERROR;
+}
+
+
+int libmk_sim_claim_interface(LibMK_Handle* handle) {
+    pthread_mutex_lock(&handle->simulator->lock);
+    bool available = !handle->simulator->claimed && !handle->simulator->closed;
+    if (available)
+        handle->simulator->claimed = true;
+    pthread_mutex_unlock(&handle->simulator->lock);
+    return available ? LIBMK_SUCCESS : LIBMK_ERR_IFACE_CLAIM_FAILED;
+}
+
+
+int libmk_sim_release_interface(LibMK_Handle* handle) {
+    pthread_mutex_lock(&handle->simulator->lock);
+    bool claimed = handle->simulator->claimed;
+    handle->simulator->claimed = false;
+    pthread_mutex_unlock(&handle->simulator->lock);
+    return claimed ? LIBMK_SUCCESS : LIBMK_ERR_IFACE_RELEASE_FAILED;
+}
+
+
+int libmk_sim_reset(LibMK_Handle* handle) {
+    LibMK_Simulator* sim = handle->simulator;
+    pthread_mutex_lock(&sim->lock);
+    sim->mode = LIBMK_FIRMWARE_CTRL;
+    sim->claimed = false;
+    pthread_mutex_unlock(&sim->lock);
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_sim_close(LibMK_Handle* handle) {
+    pthread_mutex_lock(&handle->simulator->lock);
+    handle->simulator->closed = true;
+    pthread_mutex_unlock(&handle->simulator->lock);
+}
+
+
+void libmk_sleep_us(unsigned int duration) {
+    if (duration == 0)
+        return;
+    struct timespec time = {duration / 1000000, (duration % 1000000) * 1000L};
+    nanosleep(&time, NULL);
+}
+
+
+int libmk_create_session(LibMK_Session** session, LibMK_Device** devices) {
+    *session = (LibMK_Session*) malloc(sizeof(LibMK_Session));
+    if (*session == NULL)
+        return LIBMK_ERR_NO_MEMORY;
+    LibMK_Session* s = *session;
+    s->num = 0;
+    s->handles = NULL;
+    s->workers = NULL;
+    s->job = NULL;
+    s->remaining = 0;
+    s->exit = false;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->done, NULL);
+
+    for (int i = 0; devices != NULL && devices[i] != NULL; i++) {
+        LibMK_Handle* handle;
+        int r = libmk_open(devices[i], &handle);
+        if (r == LIBMK_SUCCESS) {
+            r = libmk_session_add_handle(s, handle);
+            if (r != LIBMK_SUCCESS) {
+                handle->transport->close(handle);
+                handle->open = false;
+                libmk_free_handle(handle);
+            }
+        }
+        if (r != LIBMK_SUCCESS) {
+            libmk_free_session(s);
+            *session = NULL;
+            return r;
+        }
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_session_add_handle(LibMK_Session* session, LibMK_Handle* handle) {
+    int n = session->num + 1;
+    LibMK_Handle** handles = (LibMK_Handle**) realloc(
+        session->handles, sizeof(LibMK_Handle*) * n);
+    if (handles == NULL)
+        return LIBMK_ERR_NO_MEMORY;
+    session->handles = handles;
+    LibMK_Worker** workers = (LibMK_Worker**) realloc(
+        session->workers, sizeof(LibMK_Worker*) * n);
+    if (workers == NULL)
+        return LIBMK_ERR_NO_MEMORY;
+    session->workers = workers;
+
+    LibMK_Worker* worker = (LibMK_Worker*) malloc(sizeof(LibMK_Worker));
+    if (worker == NULL)
+        return LIBMK_ERR_NO_MEMORY;
+    worker->session = session;
+    worker->handle = handle;
+    worker->arg = NULL;
+    worker->pending = false;
+    worker->result = LIBMK_SUCCESS;
+    if (pthread_create(&worker->thread, NULL, libmk_run_worker, worker) != 0) {
+        free(worker);
+        return LIBMK_ERR_THREAD;
+    }
+    pthread_mutex_lock(&session->lock);
+    session->handles[session->num] = handle;
+    session->workers[session->num] = worker;
+    session->num = n;
+    pthread_mutex_unlock(&session->lock);
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_free_session(LibMK_Session* session) {
+    pthread_mutex_lock(&session->lock);
+    session->exit = true;
+    pthread_cond_broadcast(&session->work);
+    pthread_mutex_unlock(&session->lock);
+    for (int i = 0; i < session->num; i++) {
+        pthread_join(session->workers[i]->thread, NULL);
+        free(session->workers[i]);
+        LibMK_Handle* handle = session->handles[i];
+        // Handles of which control was not disabled are closed here
+        if (handle->open) {
+            handle->transport->close(handle);
+            handle->open = false;
+        }
+        libmk_free_handle(handle);
+    }
+    pthread_cond_destroy(&session->done);
+    pthread_cond_destroy(&session->work);
+    pthread_mutex_destroy(&session->lock);
+    free(session->workers);
+    free(session->handles);
+    free(session);
+    return LIBMK_SUCCESS;
+}
+
+
+int libmk_session_run(
+        LibMK_Session* session, LibMK_SessionJob job, void** args, int* results) {
+    pthread_mutex_lock(&session->lock);
+    session->job = job;
+    session->remaining = session->num;
+    for (int i = 0; i < session->num; i++) {
+        session->workers[i]->arg = args == NULL ? NULL : args[i];
+        session->workers[i]->pending = true;
+    }
+    pthread_cond_broadcast(&session->work);
+    while (session->remaining > 0)
+        pthread_cond_wait(&session->done, &session->lock);
+
+    int result = LIBMK_SUCCESS;
+    for (int i = 0; i < session->num; i++) {
+        int r = session->workers[i]->result;
+        if (results != NULL)
+            results[i] = r;
+        if (result == LIBMK_SUCCESS)
+            result = r;
+    }
+    pthread_mutex_unlock(&session->lock);
+    return result;
+}
+
+
+int libmk_session_enable_control(LibMK_Session* session) {
+    return libmk_session_run(session, libmk_session_enable, NULL, NULL);
+}
+
+
+int libmk_session_disable_control(LibMK_Session* session) {
+    return libmk_session_run(session, libmk_session_disable, NULL, NULL);
+}
+
+
+int libmk_session_broadcast(LibMK_Session* session, unsigned char* colors) {
+    // A session without devices has nothing to set the colors of
+    if (session->num == 0)
+        return LIBMK_SUCCESS;
+    void* args[session->num];
+    for (int i = 0; i < session->num; i++)
+        args[i] = colors;
+    return libmk_session_run(session, libmk_session_set_frame, args, NULL);
+}
+
+
+int libmk_session_scatter(LibMK_Session* session, unsigned char** frames) {
+    return libmk_session_run(
+        session, libmk_session_set_frame, (void**) frames, NULL);
+}
+
+
+int libmk_session_enable(LibMK_Handle* handle, void* arg) {
+    return libmk_enable_control(handle);
+}
+
+
+int libmk_session_disable(LibMK_Handle* handle, void* arg) {
+    return libmk_disable_control(handle);
+}
+
+
+int libmk_session_set_frame(LibMK_Handle* handle, void* colors) {
+    return libmk_set_all_led_color(handle, (unsigned char*) colors);
+}
+
+
+void* libmk_run_worker(void* arg) {
+    LibMK_Worker* worker = (LibMK_Worker*) arg;
+    LibMK_Session* session = worker->session;
+    pthread_mutex_lock(&session->lock);
+    while (true) {
+        while (!session->exit && !worker->pending)
+            pthread_cond_wait(&session->work, &session->lock);
+        if (session->exit)
+            break;
+        LibMK_SessionJob job = session->job;
+        worker->pending = false;
+        pthread_mutex_unlock(&session->lock);
+
+        int result = job(worker->handle, worker->arg);
+
+        pthread_mutex_lock(&session->lock);
+        worker->result = result;
+        if (--session->remaining == 0)
+            pthread_cond_signal(&session->done);
+    }
+    pthread_mutex_unlock(&session->lock);
+    return NULL;
 }
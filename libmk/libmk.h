@@ -11,6 +11,7 @@
  * Contains all the enums, macro and function definitions for libmk
 */
 #include "libusb.h"
+#include <pthread.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -24,6 +25,20 @@
 #define LIBMK_PACKET_TIMEOUT 50
 #define LIBMK_EP_IN 0x03
 #define LIBMK_EP_OUT 0x04
+#define LIBMK_VENDOR_ID 0x2516 // USB vendor ID of Cooler Master
+#define LIBMK_MAX_PORTS 7 // Maximum depth of a USB port path
+#define LIBMK_PIPELINE_DEPTH 4 // Maximum number of packets in flight
+#define LIBMK_CACHE_LINE 64 // Alignment of the packet buffers
+#define LIBMK_COMMAND_PCK_NUM 2 // Packets in a single command
+#define LIBMK_ACK_QUEUE 16 // Maximum number of unanswered packets
+#define LIBMK_LATENCY_BUCKETS 20 // Buckets of the latency histograms
+#define LIBMK_CACHE_MAGIC "LMKC" // Start of the cache file
+#define LIBMK_CACHE_VERSION 2 // Format version of the cache file
+#define LIBMK_LAYOUTS_MAGIC "LMKL" // Start of a layouts file
+#define LIBMK_LAYOUTS_VERSION 1 // Format version of layouts files
+#define LIBMK_HOTPLUG_RETRY 250 // Delay between attempts to open an
+                                // arrived device in milliseconds
+#define LIBMK_HOTPLUG_ATTEMPTS 20 // Attempts to open an arrived device
 
 /// @brief Maximum number of rows supported on any device
 #define LIBMK_MAX_ROWS 7
@@ -52,6 +67,12 @@ typedef enum LibMK_Result {
     LIBMK_ERR_PROTOCOL = -13, ///< Keyboard interaction protocol error
     LIBMK_ERR_INVALID_ARG = -14, ///< Invalid arguments passed by caller
     LIBMK_ERR_STILL_ACTIVE = -15, ///< Controller is still active
+    LIBMK_ERR_THREAD = -17, ///< Failed to start a thread
+    LIBMK_ERR_NOT_RUNNING = -18, ///< Required thread is not running
+    LIBMK_ERR_UNSUPPORTED = -19, ///< Not supported on this platform
+    LIBMK_ERR_FILE = -20, ///< File could not be read or written
+    LIBMK_ERR_QUEUE_FULL = -21, ///< Queue has no room for the request
+    LIBMK_ERR_NO_MEMORY = -22, ///< Memory could not be allocated
 } LibMK_Result;
 
 
@@ -85,6 +106,15 @@ typedef enum LibMK_ControlMode {
 } LibMK_ControlMode;
 
 
+/// @brief Policies for waiting on the responses to packets
+typedef enum LibMK_AckPolicy {
+    LIBMK_ACK_ALL = 0, ///< Wait for and check every response (default)
+    LIBMK_ACK_LAST = 1, ///< Check only the response to the last packet
+    LIBMK_ACK_DEFERRED = 2, ///< Drain responses in the background and
+                            ///< report errors upon the next call
+} LibMK_AckPolicy;
+
+
 /// @brief Supported keyboard layouts
 typedef enum LibMK_Layout {
     LIBMK_LAYOUT_UNKNOWN = 0,
@@ -131,22 +161,316 @@ typedef enum LibMK_Model {
 /** @brief Struct describing a supported USB device
  *
  * This struct may be used as a linked list. Holds information required
- * for the identification of the keyboard on the machine.
+ * for the identification of the keyboard on the machine. The records
+ * returned by libmk_detect are reference counted and hold a reference
+ * to their libusb_device, so they remain valid until released.
  */
 typedef struct LibMK_Device {
     char* iManufacturer; ///< Manufacturer string
     char* iProduct;  ///< Product string
+    char* iSerial; ///< Serial number string, empty if not available
     int bVendor; ///< USB Vendor ID number
     int bDevice; ///< USB Device ID number
     LibMK_Model model; ///< Model number
     struct LibMK_Device* next; ///< Linked list attribute
     libusb_device* device; ///< libusb_device struct instance
+    unsigned char bus; ///< Bus number of the device
+    unsigned char ports[LIBMK_MAX_PORTS]; ///< Port path of the device
+    int num_ports; ///< Number of ports in the port path
+    int refs; ///< Number of references to this record
 } LibMK_Device;
 
 
+/** @brief Callback for devices arriving at or leaving the machine
+ *
+ * @param device: LibMK_Device record of the device. The record is only
+ *    guaranteed to remain valid during the call, unless a reference is
+ *    taken with libmk_ref_device.
+ * @param arrived: true if the device arrived, false if it left
+ * @param data: Pointer passed to libmk_start_registry
+ */
+typedef void (*LibMK_DeviceCallback)(
+    LibMK_Device* device, bool arrived, void* data);
+
+
+/** @brief Internal struct. Hotplug event waiting for the registry */
+typedef struct LibMK_HotplugEvent {
+    libusb_device* device; ///< Device of the event, referenced
+    bool arrived; ///< Whether the device arrived or left
+    unsigned int attempts; ///< Failed attempts to open the device
+    struct LibMK_HotplugEvent* next; ///< Linked list attribute
+} LibMK_HotplugEvent;
+
+
+/** @brief Internal struct. String descriptors of a device
+ *
+ * Reading the string descriptors of a device requires opening it, so
+ * they are read only once for every device. While a device remains
+ * connected, its entry is found by its bus number, port path and
+ * address. After the device is enumerated again, its serial number is
+ * read and the entry is identified by vendor, product and serial
+ * number, or by port path for devices without a serial number. Once
+ * control over the device has been enabled, the layout and firmware
+ * are stored as well. If a cache file is set, the entries are saved
+ * in it.
+ */
+typedef struct LibMK_Descriptor {
+    unsigned char bus; ///< Bus number of the device
+    unsigned char ports[LIBMK_MAX_PORTS]; ///< Port path of the device
+    int num_ports; ///< Number of ports in the port path
+    int bVendor; ///< USB Vendor ID number
+    int bDevice; ///< USB Device ID number
+    char iManufacturer[LIBMK_USB_DESCR_LEN]; ///< Manufacturer string
+    char iProduct[LIBMK_USB_DESCR_LEN]; ///< Product string
+    char iSerial[LIBMK_USB_DESCR_LEN]; ///< Serial number string
+    LibMK_Layout layout; ///< Layout, LIBMK_LAYOUT_UNKNOWN if not known
+    char firmware[6]; ///< Firmware version string
+    struct LibMK_Descriptor* next; ///< Linked list attribute, the
+                                   ///< members before it are saved
+    unsigned char address; ///< Address of the device on the bus, 0 if
+                           ///< not connected since the entry was read
+} LibMK_Descriptor;
+
+
+/** @brief Internal struct. Header of the cache file
+ *
+ * Followed by the saved members of the LibMK_Descriptor entries. The
+ * file is discarded if the header does not match the library.
+ */
+typedef struct LibMK_CacheHeader {
+    char magic[4]; ///< LIBMK_CACHE_MAGIC
+    unsigned int version; ///< LIBMK_CACHE_VERSION
+    unsigned int entry_size; ///< Bytes saved for every entry
+    unsigned int num; ///< Number of entries in the file
+} LibMK_CacheHeader;
+
+
+/** @brief Internal struct. Packet buffers owned by a LibMK_Handle
+ *
+ * Allocated once when the handle is created and aligned to
+ * LIBMK_CACHE_LINE, so that packets are encoded and exchanged without
+ * any allocations. Every buffer is exactly one packet in size.
+ */
+typedef struct LibMK_Buffers {
+    unsigned char frame[LIBMK_ALL_LED_PCK_NUM][LIBMK_PACKET_SIZE];
+                                  ///< Packets of libmk_set_all_led_color
+    unsigned char command[LIBMK_COMMAND_PCK_NUM][LIBMK_PACKET_SIZE];
+                                  ///< Packets of all other commands
+    unsigned char responses[LIBMK_PIPELINE_DEPTH][LIBMK_PACKET_SIZE];
+                                  ///< Buffers for the IN transfers
+} LibMK_Buffers;
+
+
+/** @brief Internal struct. State of the packet pipeline of a handle
+ *
+ * Tracks the packets that are exchanged with a device by
+ * libmk_send_packets. The transfers of the handle are used as rings of
+ * LIBMK_PIPELINE_DEPTH slots. As the device answers the packets in
+ * order, the n-th completed IN transfer carries the response to the
+ * n-th packet sent. Depending on the LibMK_AckPolicy of the handle,
+ * responses may still be outstanding after libmk_send_packets returns.
+ * The counters wrap around and are only compared by their difference.
+ */
+typedef struct LibMK_Pipeline {
+    unsigned int submitted; ///< Number of packets submitted for sending
+    unsigned int sent; ///< Number of completed OUT transfers
+    unsigned int reading; ///< Number of submitted IN transfers
+    unsigned int received; ///< Number of completed IN transfers
+    unsigned char* targets[LIBMK_ACK_QUEUE]; ///< Per packet, buffer to
+                                             ///< copy the response to
+    bool checked[LIBMK_ACK_QUEUE]; ///< Per packet, whether to check the
+                                   ///< response for protocol errors
+    bool required[LIBMK_ACK_QUEUE]; ///< Per packet, whether a missing
+                                    ///< response is an error
+    unsigned char** packets; ///< Packets of the batch being sent
+    unsigned int first; ///< Number of the first packet of the batch
+    unsigned long times[LIBMK_ACK_QUEUE]; ///< Per packet, time it was
+                                          ///< submitted or sent in us
+    int progress; ///< Set when any transfer completes
+    bool cancelled; ///< Outstanding transfers have been cancelled
+    bool failed; ///< A transfer failed, unread responses are abandoned
+    int result; ///< First error that has not yet been reported
+} LibMK_Pipeline;
+
+
+/** @brief Counters of the communication with a device
+ *
+ * Collected by every LibMK_Handle and retrieved with libmk_get_stats.
+ * Bucket 0 of a latency histogram counts latencies below 2 us, bucket
+ * i > 0 counts latencies from 2^i up to 2^(i+1) us and the last bucket
+ * also counts all latencies above it.
+ */
+typedef struct LibMK_Stats {
+    unsigned long packets_sent; ///< Number of OUT transfers completed
+    unsigned long responses; ///< Number of IN transfers completed
+    unsigned long timeouts; ///< Number of transfers that timed out
+    unsigned long protocol_errors; ///< Number of error responses
+    unsigned long bytes_sent; ///< Bytes transferred to the device
+    unsigned long bytes_received; ///< Bytes transferred from the device
+    unsigned long out_latency[LIBMK_LATENCY_BUCKETS]; ///< Time from
+                                  ///< submitting to sending a packet
+    unsigned long in_latency[LIBMK_LATENCY_BUCKETS]; ///< Time from
+                                  ///< sending a packet to its response
+    unsigned long frame_latency[LIBMK_LATENCY_BUCKETS]; ///< Duration of
+                                  ///< libmk_set_all_led_color
+    unsigned long recoveries; ///< Number of successful recoveries
+    unsigned long failed_recoveries; ///< Number of failed recoveries
+    unsigned long recovery_latency[LIBMK_LATENCY_BUCKETS]; ///< Time
+                                  ///< from a failure to its recovery
+} LibMK_Stats;
+
+
+/** @brief Internal struct. Destinations of the keys within a frame
+ *
+ * Built by libmk_build_scatter once the layout of a device is known.
+ * Only the keys present in the layout are listed, each with the byte
+ * offset of its color in the array passed to libmk_set_all_led_color
+ * and the byte offset of its color in the frame buffers of the handle.
+ */
+typedef struct LibMK_Scatter {
+    unsigned short num; ///< Number of keys in the table
+    unsigned short src[LIBMK_MAX_ROWS * LIBMK_MAX_COLS]; ///< Offsets of
+                                  ///< the colors in the color array
+    unsigned short dst[LIBMK_MAX_ROWS * LIBMK_MAX_COLS]; ///< Offsets of
+                                  ///< the colors in the frame buffers
+} LibMK_Scatter;
+
+
+/// @brief Key present on a keyboard and its internal address
+typedef struct LibMK_Key {
+    unsigned char row; ///< Zero-indexed row of the key
+    unsigned char col; ///< Zero-indexed column of the key
+    unsigned char offset; ///< Internal address of the key
+    unsigned char reserved; ///< Must be zero
+} LibMK_Key;
+
+
+/** @brief Map of the keys present on a model of keyboard
+ *
+ * Lists only the keys that are present, and indexes them both by row
+ * and column and by offset. The built-in maps cover the supported
+ * models, further maps are loaded with libmk_load_layouts.
+ */
+typedef struct LibMK_KeyMap {
+    int bDevice; ///< USB Device ID the map applies to, 0 for any device
+    LibMK_Layout layout; ///< Layout the map applies to
+    LibMK_Size size; ///< Size of keyboard the map applies to
+    const LibMK_Key* keys; ///< Keys present on the keyboard
+    int num; ///< Number of keys
+    unsigned char offsets[LIBMK_MAX_ROWS][LIBMK_MAX_COLS]; ///< Offsets of
+                                  ///< the keys by row and column, 0xFF
+                                  ///< if there is no key
+    unsigned char index[256]; ///< Index in keys by offset, 0xFF if no
+                              ///< key has the offset
+    void* mapping; ///< Mapped layouts file to unmap, if any
+    size_t length; ///< Length of the mapping
+    struct LibMK_KeyMap* next; ///< Linked list attribute
+} LibMK_KeyMap;
+
+
+/** @brief Internal struct. Header of a layouts file
+ *
+ * Followed by num maps, each a LibMK_LayoutRecord followed by its
+ * LibMK_Key entries. The file is mapped into memory as is.
+ */
+typedef struct LibMK_LayoutsHeader {
+    char magic[4]; ///< LIBMK_LAYOUTS_MAGIC
+    unsigned int version; ///< LIBMK_LAYOUTS_VERSION
+    unsigned int num; ///< Number of maps in the file
+} LibMK_LayoutsHeader;
+
+
+/// @brief Internal struct. Map of a layouts file
+typedef struct LibMK_LayoutRecord {
+    unsigned short bDevice; ///< USB Device ID, 0 for any device
+    unsigned char layout; ///< LibMK_Layout of the map
+    unsigned char size; ///< LibMK_Size of the map
+    unsigned short num; ///< Number of LibMK_Key following
+    unsigned short reserved; ///< Must be zero
+} LibMK_LayoutRecord;
+
+
+/** @brief Internal struct. Frame mailbox of a presentation thread
+ *
+ * Frames posted by producers overwrite the frame that is waiting in
+ * the mailbox. The thread sends the frame in the mailbox to the device
+ * at most once per interval, so only the most recent frame is shown.
+ */
+typedef struct LibMK_Presenter {
+    pthread_t thread; ///< Presentation thread
+    pthread_mutex_t lock; ///< Protects all other members
+    pthread_cond_t cond; ///< Signalled when a frame is posted or exit
+    unsigned char frame[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]; ///< Frame in
+                                  ///< the mailbox
+    bool full; ///< Whether the frame is a single color in frame[0][0]
+    bool pending; ///< Whether the frame has not been sent yet
+    bool exit; ///< Set to stop the thread
+    long interval; ///< Minimum time between frames in nanoseconds
+    unsigned int posted; ///< Number of frames posted
+    unsigned int presented; ///< Number of frames sent to the device
+    double fps; ///< Frames sent per second, measured every second
+    struct timespec window; ///< Start of the current measurement
+    unsigned int measured; ///< Frames sent since the window started
+    int result; ///< First error that has not yet been reported
+} LibMK_Presenter;
+
+
+struct LibMK_Handle;
+
+/** @brief Functions performing the I/O of a LibMK_Handle
+ *
+ * Every handle refers to a transport that exchanges the packets with
+ * its device. LIBMK_USB_TRANSPORT communicates with a keyboard using
+ * libusb and LIBMK_SIM_TRANSPORT with a simulated keyboard.
+ */
+typedef struct LibMK_Transport {
+    int (*send_packets)(
+        struct LibMK_Handle* handle, unsigned char** packets, int n,
+        bool response_required, bool exchange, LibMK_AckPolicy policy);
+                                  ///< Send packets, see libmk_run_pipeline
+    int (*claim_interface)(struct LibMK_Handle* handle); ///< Claim the
+                                  ///< LED interface of the device
+    int (*release_interface)(struct LibMK_Handle* handle); ///< Release
+                                  ///< the LED interface of the device
+    int (*reset)(struct LibMK_Handle* handle); ///< Reset the device
+    void (*close)(struct LibMK_Handle* handle); ///< Close the device
+} LibMK_Transport;
+
+
+/** @brief State of a simulated keyboard
+ *
+ * Created by libmk_set_simulated_device. Packets sent to the simulated
+ * keyboard are decoded into this state as a keyboard would, and are
+ * answered after latency microseconds for the packet and latency
+ * microseconds for the response. Like transfers to a real device,
+ * packets sent while the interface is not claimed or after the device
+ * has been closed fail with LIBMK_ERR_TRANSFER.
+ */
+typedef struct LibMK_Simulator {
+    pthread_mutex_t lock; ///< Protects all other members
+    LibMK_Layout layout; ///< Layout reported in the firmware version
+    LibMK_ControlMode mode; ///< Active control mode
+    LibMK_Effect effect; ///< Active effect
+    unsigned char details[LIBMK_PACKET_SIZE]; ///< Last effect details
+    char profile; ///< Active profile, 1 to 4
+    unsigned char leds[LIBMK_ALL_LED_PCK_NUM * LIBMK_ALL_LED_PER_PCK][3];
+                                  ///< Colors of the LEDs by offset
+    unsigned int saved; ///< Number of times a profile was saved
+    unsigned int latency; ///< Duration of each transfer in microseconds
+    bool claimed; ///< Whether the LED interface is claimed
+    bool closed; ///< Whether the device has been closed
+} LibMK_Simulator;
+
+
 /** @brief Array of strings representing the supported models */
 extern const char* LIBMK_MODEL_STRINGS[];
 
+/** @brief Transport for keyboards connected over USB */
+extern const LibMK_Transport LIBMK_USB_TRANSPORT;
+
+/** @brief Transport for simulated keyboards */
+extern const LibMK_Transport LIBMK_SIM_TRANSPORT;
+
 /** @brief Struct describing an opened supported device
  *
  * Result of libmk_set_device(LibMK_Model, LibMK_Handle**). Contains all
@@ -166,9 +490,47 @@ typedef struct LibMK_Handle {
                                   ///< device endpoints
     bool open; ///< Current state of the handle. If closed, the handle
                ///< is no longer valid. Handles may not be re-opened.
+    struct libusb_transfer* out[LIBMK_PIPELINE_DEPTH]; ///< Asynchronous
+                                  ///< OUT transfers of the pipeline
+    struct libusb_transfer* in[LIBMK_PIPELINE_DEPTH]; ///< Asynchronous
+                                  ///< IN transfers of the pipeline
+    LibMK_Buffers* buffers; ///< Packet buffers owned by the handle
+    LibMK_Pipeline pipeline; ///< State of the packet pipeline
+    pthread_mutex_t pipeline_lock; ///< Protects LibMK_Pipeline pipeline
+    pthread_mutex_t command_lock; ///< Reentrant lock held while a
+                                  ///< command is sent to the device
+    unsigned int locks; ///< Number of times the command lock was taken
+                        ///< with libmk_lock_handle, protected by it
+    bool detached; ///< Whether the kernel driver was detached when
+                   ///< claiming the interface
+    unsigned int recovery_attempts; ///< Attempts to recover from a
+                                    ///< failed transfer, 0 if disabled
+    unsigned int recovery_backoff; ///< Delay before the first attempt
+    bool recovering; ///< Whether a recovery is in progress
+    bool confirm; ///< Whether the layout was taken from the cache and
+                  ///< has not been confirmed yet
+    LibMK_AckPolicy ack_policy; ///< Policy for awaiting responses
+    unsigned char shadow[LIBMK_ALL_LED_PCK_NUM][LIBMK_ALL_LED_PER_PCK * 3];
+                                  ///< Colors of the last frame sent
+    bool shadow_valid; ///< Whether the shadow frame matches the device
+    unsigned char tolerance; ///< Per-channel tolerance for frame deltas
+    LibMK_ControlMode mode; ///< Control mode last set on the device
+    LibMK_Effect effect; ///< Effect last set on the device
+    bool mode_valid; ///< Whether mode matches the device
+    bool effect_valid; ///< Whether effect matches the device
+    const LibMK_KeyMap* keymap; ///< Keys of the device, NULL if the
+                                ///< layout is not supported
+    LibMK_Scatter scatter; ///< Destinations of the keys within a frame
+    LibMK_Presenter* presenter; ///< Presentation thread, NULL if stopped
+    pthread_mutex_t presenter_lock; ///< Protects the presenter pointer
+    LibMK_Stats stats; ///< Counters, protected by pipeline_lock
+    const LibMK_Transport* transport; ///< Functions performing the I/O
+    LibMK_Simulator* simulator; ///< Simulated keyboard, NULL if none
+    LibMK_Device* device; ///< Record of the device, NULL if simulated
 } LibMK_Handle;
 
 
+
 /** @brief Struct describing an effect with custom settings
  *
  * Apart from the default settings that are applied when an effect is
@@ -195,6 +557,14 @@ typedef struct LibMK_Effect_Details {
     unsigned char background[3]; ///< Background color of the effect
 } LibMK_Effect_Details;
 
+
+/// @brief Color of a single key, as passed to libmk_set_leds
+typedef struct LibMK_KeyColor {
+    unsigned char row; ///< Zero-indexed row index
+    unsigned char col; ///< Zero-indexed column index
+    unsigned char color[3]; ///< RGB color of the key
+} LibMK_KeyColor;
+
 /** @brief Initialize the library and its dependencies to a usable state
  *
  * Initializes a default libusb context for use throughout the library.
@@ -223,6 +593,96 @@ int libmk_exit();
  */
 int libmk_detect_devices(LibMK_Model** model_list);
 
+/** @brief Search for devices and return a record for each of them
+ *
+ * @param devices: Pointer to store a NULL-terminated array of pointers
+ *    to LibMK_Device records in. The array must be freed with
+ *    libmk_free_device_list.
+ * @returns The number of found devices, or a LibMK_Result error code.
+ *
+ * The records may be opened with libmk_open without searching for the
+ * device again, and identify a device by its port path and serial
+ * number, so that multiple devices of the same model can be told apart.
+ */
+int libmk_detect(LibMK_Device*** devices);
+
+/** @brief Start keeping track of the devices attached to the machine
+ *
+ * @param callback: Function to call when a supported device arrives or
+ *    leaves, may be NULL. Called from a thread of the library.
+ * @param data: Pointer to pass to the callback
+ * @returns LibMK_Result result code
+ *
+ * Uses the hotplug support of libusb to maintain a registry of the
+ * supported devices. While the registry is running, libmk_detect and
+ * libmk_detect_devices return the devices in the registry instead of
+ * searching all USB devices. The devices attached when the registry is
+ * started are in the registry when this function returns, without the
+ * callback being called for them. Devices that cannot be opened yet,
+ * for example because their permissions have not been applied, are
+ * retried for a few seconds and the callback is called once they are
+ * added.
+ */
+int libmk_start_registry(LibMK_DeviceCallback callback, void* data);
+
+/** @brief Stop keeping track of the devices attached to the machine */
+void libmk_stop_registry(void);
+
+/** @brief Internal function. Release the devices and events of the registry
+ *
+ * Must be called with the lock of the registry held, once no thread
+ * adds to it anymore. Marks the registry as stopped.
+ */
+void libmk_clear_registry(void);
+
+/** @brief Internal function. libusb hotplug callback of the registry */
+int libmk_hotplug_callback(
+    libusb_context* context, libusb_device* device,
+    libusb_hotplug_event event, void* data);
+
+/** @brief Internal function. Process the hotplug events of the registry */
+void* libmk_run_registry(void* arg);
+
+/** @brief Internal function. Apply a hotplug event to the registry
+ *
+ * @param event: LibMK_HotplugEvent to apply. Freed by this function,
+ *    unless the arrived device could not be opened yet. The event is
+ *    then kept pending and retried by the registry thread.
+ * @param callback: Whether to call the callback of the registry
+ */
+void libmk_process_hotplug(LibMK_HotplugEvent* event, bool callback);
+
+/** @brief Free an array of records returned by libmk_detect
+ *
+ * @param devices: NULL-terminated array of LibMK_Device records
+ * @param unref: Whether to release a reference to every record
+ */
+void libmk_free_device_list(LibMK_Device** devices, bool unref);
+
+/** @brief Take a reference to a device record
+ *
+ * @param device: LibMK_Device record to keep alive
+ * @returns The record passed
+ */
+LibMK_Device* libmk_ref_device(LibMK_Device* device);
+
+/** @brief Release a reference to a device record
+ *
+ * @param device: LibMK_Device record, freed with its last reference
+ */
+void libmk_unref_device(LibMK_Device* device);
+
+/** @brief Open a device found by libmk_detect
+ *
+ * @param device: LibMK_Device record of the device to open
+ * @param handle: Pointer to pointer of struct LibMK_Handle, as for
+ *    libmk_set_device. If NULL the global handle is set.
+ * @returns LibMK_Result result code
+ *
+ * The handle takes a reference to the record for as long as it exists.
+ */
+int libmk_open(LibMK_Device* device, LibMK_Handle** handle);
+
 /** @brief Internal function. Loads the details of a device
  *
  * @param device: libusb device descriptor to load details for
@@ -231,14 +691,132 @@ int libmk_detect_devices(LibMK_Model** model_list);
  *
  * Loads the details of a USB device into a LibMK_Device struct instance.
  * The details are used by libmk_detect_devices to determine whether a
- * device is supported.
+ * device is supported. Devices of other vendors are not opened.
  */
 LibMK_Device* libmk_open_device(libusb_device* device);
 
-/** @brief Internal function. Allocate and fill LibMK_Device struct */
+/** @brief Internal function. Loads the details of a device
+ *
+ * @param device: libusb device descriptor to load details for
+ * @param record: Pointer to store the LibMK_Device instance in, set to
+ *    NULL if the device is not supported
+ * @returns LibMK_Result result code, LIBMK_ERR_DEV_OPEN_FAILED if the
+ *    device could not be opened to read its details
+ *
+ * Variant of libmk_open_device that reports why no record was created.
+ */
+int libmk_read_device(libusb_device* device, LibMK_Device** record);
+
+/** @brief Internal function. Whether a device may be supported
+ *
+ * @param bVendor: USB Vendor ID number of the device
+ * @param bDevice: USB Device ID number of the device
+ * @returns true if the vendor is Cooler Master. The product ID is not
+ *    checked, as it differs between models and board revisions.
+ */
+bool libmk_is_known_device(int bVendor, int bDevice);
+
+/** @brief Internal function. Read the string descriptors of a device
+ *
+ * @param device: libusb device to read the strings of
+ * @param descriptor: Device descriptor of the device
+ * @param manufacturer: Buffer of LIBMK_USB_DESCR_LEN for the
+ *    manufacturer string
+ * @param product: Buffer of LIBMK_USB_DESCR_LEN for the product string
+ * @param serial: Buffer of LIBMK_USB_DESCR_LEN for the serial number
+ * @returns LibMK_Result result code
+ *
+ * The strings are cached by the port and address of the device, so
+ * the device is only opened when it is first detected or after it has
+ * been enumerated again. The serial number is then read to find the
+ * other strings in the cache.
+ */
+int libmk_get_descriptor(
+    libusb_device* device, struct libusb_device_descriptor* descriptor,
+    char* manufacturer, char* product, char* serial);
+
+/** @brief Internal function. Store the location of a descriptor entry
+ *
+ * Other entries on the same port are no longer found by address. Must
+ * be called with the lock of the descriptors held.
+ */
+void libmk_place_descriptor(
+    LibMK_Descriptor* entry, unsigned char bus, unsigned char* ports,
+    int num_ports, unsigned char address);
+
+/** @brief Internal function. Free the cached string descriptors */
+void libmk_clear_descriptors(void);
+
+/** @brief Set the file to cache the details of devices in
+ *
+ * @param path: Path of the cache file, or NULL to no longer use a
+ *    cache file. The file is created if it does not exist.
+ * @returns LibMK_Result result code
+ *
+ * Must be called after libmk_init. The descriptor strings, layout and
+ * firmware version of every device that control is enabled over are
+ * saved in the file. Afterwards, only the serial number of a device is
+ * read when it is first detected, and enabling control does not wait for
+ * the firmware version. Instead, the layout is confirmed after the
+ * first colors have been set. If it turns out to be outdated, the
+ * cache is updated and the next frame is sent in full.
+ */
+int libmk_set_cache_file(const char* path);
+
+/** @brief Internal function. Load the entries of the cache file
+ *
+ * Must be called with the lock of the descriptors held. Entries of
+ * devices that are already known are skipped.
+ */
+void libmk_load_cache(void);
+
+/** @brief Internal function. Save all entries with a known layout
+ *
+ * @returns LibMK_Result result code, LIBMK_ERR_FILE if the file could
+ *    not be written
+ *
+ * Must be called with the lock of the descriptors held. The file is
+ * replaced atomically.
+ */
+int libmk_save_cache(void);
+
+/** @brief Internal function. Find the descriptor entry of a device
+ *
+ * @param device: Record of the device to find
+ * @returns Entry with the vendor, product and serial of the device, or
+ *    with its port path if the device has no serial number. NULL if
+ *    there is no entry for the device.
+ *
+ * Must be called with the lock of the descriptors held.
+ */
+LibMK_Descriptor* libmk_find_descriptor(LibMK_Device* device);
+
+/** @brief Internal function. Take the layout of a device from the cache
+ *
+ * @returns true if the layout was known and set on the handle
+ */
+bool libmk_get_cached_layout(LibMK_Handle* handle);
+
+/** @brief Internal function. Store the firmware of a device in the cache
+ */
+void libmk_cache_firmware(LibMK_Handle* handle, LibMK_Firmware* fw);
+
+/** @brief Internal function. Confirm a layout taken from the cache
+ *
+ * Called after the first colors have been set, so that reading the
+ * firmware version does not delay them. If the layout does not match,
+ * the handle and the cache are updated.
+ */
+int libmk_confirm_cache(LibMK_Handle* handle);
+
+/** @brief Internal function. Allocate and fill LibMK_Device struct
+ *
+ * The record is created with a single reference and takes a reference
+ * to the libusb_device. Returns NULL if memory could not be allocated.
+ */
 LibMK_Device* libmk_create_device(
     LibMK_Model model, libusb_device* device,
-    char* iManufacturer, char* iProduct,
+    char* iManufacturer, char* iProduct, char* iSerial,
     int bVendor, int bDevice);
 
 /** @brief Internal function. Free memory of allocated LibMK_Device */
@@ -253,6 +831,13 @@ LibMK_Model libmk_ident_model(char* product);
 /** @brief Internal function. Allocate and fill LibMK_Handle struct */
 int libmk_create_handle(LibMK_Handle** handle, LibMK_Device* device);
 
+/** @brief Internal function. Allocate LibMK_Handle without a device
+ *
+ * Initializes all members that do not depend on the transport of the
+ * handle. The size of the handle is determined from the model.
+ */
+int libmk_alloc_handle(LibMK_Handle** handle, LibMK_Model model);
+
 /** @brief Internal function. Free memory of allocated LibMK_Handle */
 int libmk_free_handle(LibMK_Handle* handle);
 
@@ -278,7 +863,9 @@ int libmk_set_device(LibMK_Model model, LibMK_Handle** handle);
  *
  * Must be called in order to be able to control the keyboard. Claims
  * the LED interface on the keyboard USB controller with the appropriate
- * endpoints for control.
+ * endpoints for control. If the interface was claimed but the device
+ * did not accept control, the interface remains claimed until
+ * libmk_disable_control is called.
  */
 int libmk_enable_control(LibMK_Handle* handle);
 
@@ -290,13 +877,133 @@ int libmk_enable_control(LibMK_Handle* handle);
  *
  * Must be called when the user is done controlling the keyboard.
  * Support for re-enabling of control on the same LibMK_Handle is not
- * guaranteed.
+ * guaranteed. The device is reset, so it re-enumerates and key input
+ * is interrupted for a moment. See libmk_handoff_control.
  */
 int libmk_disable_control(LibMK_Handle* handle);
 
+/** @brief Hand control of the keyboard back without resetting it
+ *
+ * @param handle: LibMK_Handle* for the device to release. If NULL, the
+ *    global handle is used.
+ * @returns LibMK_Result result code
+ *
+ * Alternative to libmk_disable_control that restores the firmware
+ * control mode, releases the LED interface and re-attaches the kernel
+ * driver, but does not reset the device. The keyboard does not drop
+ * off the bus, so key input is not interrupted and control may be
+ * enabled again immediately, for example by another program. The
+ * colors last set remain until the firmware changes them.
+ */
+int libmk_handoff_control(LibMK_Handle* handle);
+
+/** @brief Internal function. Release control of the keyboard
+ *
+ * @param handle: LibMK_Handle* for the device to release
+ * @param reset: Whether to reset the device after releasing it
+ *
+ * A handle of which the device could not be recovered is only closed.
+ */
+int libmk_end_control(LibMK_Handle* handle, bool reset);
+
+/** @brief Obtain exclusive use of a handle for a sequence of commands
+ *
+ * @param handle: LibMK_Handle to lock. If NULL uses the global device
+ *    handle.
+ * @returns LibMK_Result result code
+ *
+ * All functions that communicate with the device lock the handle for
+ * the duration of the command, so that the packets of commands from
+ * different threads are never interleaved. This function is only
+ * required to keep multiple commands together. The lock is reentrant
+ * and must be released as many times with libmk_unlock_handle as it
+ * was obtained. A running presenter also takes the lock, so it cannot
+ * be stopped while the handle is locked and libmk_stop_presenter,
+ * libmk_disable_control and libmk_handoff_control then return
+ * LIBMK_ERR_STILL_ACTIVE.
+ */
+int libmk_lock_handle(LibMK_Handle* handle);
+
+/** @brief Release a handle locked with libmk_lock_handle
+ *
+ * @param handle: LibMK_Handle to unlock. If NULL uses the global device
+ *    handle.
+ * @returns LibMK_Result result code
+ */
+int libmk_unlock_handle(LibMK_Handle* handle);
+
+/** @brief Internal function. Whether the calling thread locked a handle
+ *
+ * @returns true if the thread holds the lock of the handle obtained
+ *    with libmk_lock_handle
+ */
+bool libmk_holds_handle(LibMK_Handle* handle);
+
 /** @brief Internal function. Claims USB LED interface on device */
 int libmk_claim_interface(LibMK_Handle* handle);
 
+/** @brief Initialize a simulated device within the library
+ *
+ * @param model: Model of the keyboard to simulate
+ * @param layout: Layout of the keyboard to simulate
+ * @param handle: Pointer to pointer of struct LibMK_Handle, as for
+ *    libmk_set_device. If NULL the global handle is set.
+ * @returns LibMK_Result result code
+ *
+ * The handle may be used as any other handle, without a keyboard being
+ * connected. The state of the simulated keyboard is available in the
+ * simulator member of the handle.
+ */
+int libmk_set_simulated_device(
+    LibMK_Model model, LibMK_Layout layout, LibMK_Handle** handle);
+
+/** @brief Set the latency of every transfer to a simulated device
+ *
+ * @param handle: LibMK_Handle of a simulated device. If NULL the global
+ *    handle is used.
+ * @param latency: Duration of every transfer in microseconds
+ * @returns LibMK_Result result code
+ */
+int libmk_set_simulated_latency(LibMK_Handle* handle, unsigned int latency);
+
+/** @brief Retrieve the colors of the LEDs of a simulated device
+ *
+ * @param handle: LibMK_Handle of a simulated device. If NULL the global
+ *    handle is used.
+ * @param colors: Array of unsigned char of
+ *    [LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3] size to store the colors in.
+ *    Positions without a key are set to zero.
+ * @returns LibMK_Result result code
+ */
+int libmk_get_simulated_leds(LibMK_Handle* handle, unsigned char* colors);
+
+/** @brief Internal function. LibMK_Transport functions for libusb */
+int libmk_usb_claim_interface(LibMK_Handle* handle);
+int libmk_usb_release_interface(LibMK_Handle* handle);
+int libmk_usb_reset(LibMK_Handle* handle);
+void libmk_usb_close(LibMK_Handle* handle);
+
+/** @brief Internal function. LibMK_Transport functions of the simulator */
+int libmk_sim_send_packets(
+    LibMK_Handle* handle, unsigned char** packets, int n,
+    bool response_required, bool exchange, LibMK_AckPolicy policy);
+int libmk_sim_claim_interface(LibMK_Handle* handle);
+int libmk_sim_release_interface(LibMK_Handle* handle);
+int libmk_sim_reset(LibMK_Handle* handle);
+void libmk_sim_close(LibMK_Handle* handle);
+
+/** @brief Internal function. Decode a packet into the simulator state
+ *
+ * @param sim: LibMK_Simulator receiving the packet
+ * @param packet: Packet of LIBMK_PACKET_SIZE sent to the simulator
+ * @param response: Buffer of LIBMK_PACKET_SIZE to store the response in
+ */
+void libmk_sim_process(
+    LibMK_Simulator* sim, unsigned char* packet, unsigned char* response);
+
+/** @brief Internal function. Sleep for a number of microseconds */
+void libmk_sleep_us(unsigned int duration);
+
 /** @brief Sends packet to put the keyboard in LIBMK_EFFECT_CTRL
  *
  * @param handle: LibMK_Handle* for the device to send the packet to. If
@@ -321,9 +1028,30 @@ int libmk_get_device_ident(LibMK_Handle* handle);
  */
 int libmk_get_firmware_version(LibMK_Handle* handle, LibMK_Firmware** fw);
 
-
+/** @brief Set the control mode of the device
+ *
+ * @param handle: LibMK_Handle for the device to set the control mode
+ *    of. If NULL, the global handle is used.
+ * @param mode: LibMK_ControlMode to put the device in
+ * @returns LibMK_Result result code
+ *
+ * The handle keeps track of the control mode and effect of the device,
+ * so the packet is only sent if the device is not yet in this mode.
+ */
 int libmk_set_control_mode(LibMK_Handle* handle, LibMK_ControlMode mode);
 
+/** @brief Forget the control mode, effect and frame of the device
+ *
+ * @param handle: LibMK_Handle for the device to invalidate the state
+ *    of. If NULL, the global handle is used.
+ * @returns LibMK_Result result code
+ *
+ * Must be called if the state of the device was changed without using
+ * this handle, for example after a reset of the device, so that the
+ * next control mode, effect and frame are sent in their entirety.
+ */
+int libmk_invalidate_state(LibMK_Handle* handle);
+
 /** @brief Send a single packet and verify the response
  *
  * @param handle: LibMK_Handle for the device to send the packet to
@@ -359,6 +1087,9 @@ int libmk_exch_packet(LibMK_Handle* handle, unsigned char* packet);
  *    global device handle
  * @param effect: LibMK_Effect specifier of effect to activate
  * @returns LibMK_Result result code
+ *
+ * Packets are only sent if the device is not already in
+ * LIBMK_EFFECT_CTRL with this effect active.
  */
 int libmk_set_effect(LibMK_Handle* handle, LibMK_Effect effect);
 
@@ -393,6 +1124,48 @@ int libmk_set_full_color(
  */
 int libmk_set_all_led_color(LibMK_Handle* handle, unsigned char* colors);
 
+/** @brief Set the tolerance used to skip unchanged frame packets
+ *
+ * @param handle: LibMK_Handle for the device to set the tolerance for.
+ *    If NULL uses the global device handle.
+ * @param tolerance: Maximum difference per color channel for which a
+ *    key is considered unchanged. Zero (the default) disables the
+ *    lossy mode.
+ * @returns LibMK_Result result code
+ *
+ * libmk_set_all_led_color only sends the packets of which the colors
+ * differ from the last frame sent. If the colors of a key differ by no
+ * more than the tolerance in every channel from the colors previously
+ * sent, the previous colors are kept so that more packets may be
+ * skipped.
+ */
+int libmk_set_color_tolerance(LibMK_Handle* handle, unsigned char tolerance);
+
+/** @brief Force the next frame to be sent in its entirety
+ *
+ * @param handle: LibMK_Handle for the device to invalidate the frame
+ *    of. If NULL uses the global device handle.
+ * @returns LibMK_Result result code
+ *
+ * Must be called if the LEDs of the device were changed without using
+ * this handle, so that libmk_set_all_led_color does not skip packets
+ * based on an outdated copy of the last frame.
+ */
+int libmk_invalidate_frame(LibMK_Handle* handle);
+
+/** @brief Internal function. Select the packets of a frame to send
+ *
+ * @param handle: LibMK_Handle holding the last frame sent
+ * @param packets: LIBMK_ALL_LED_PCK_NUM packets of the new frame
+ * @param changed: Array to store the pointers of the packets to send in
+ * @returns Number of packets stored in changed
+ *
+ * Applies the tolerance of the handle to the packets of the new frame
+ * and then selects the packets that differ from the last frame sent.
+ */
+int libmk_diff_frame(
+    LibMK_Handle* handle, unsigned char** packets, unsigned char** changed);
+
 /** @brief Set the color of a single LED on the keyboard
  *
  * @param handle: LibMK_Handle for device to set the color of the key
@@ -408,6 +1181,25 @@ int libmk_set_single_led(
     LibMK_Handle* handle, unsigned char row, unsigned char col,
     unsigned char r, unsigned char g, unsigned char b);
 
+/** @brief Set the colors of multiple keys on the keyboard
+ *
+ * @param handle: LibMK_Handle for device to set the colors of the keys
+ *    on. If NULL uses the global device handle.
+ * @param keys: Array of LibMK_KeyColor with the new colors of the keys.
+ *    If a key is listed multiple times, the last color is used.
+ * @param n: Number of elements in keys
+ * @returns LibMK_Result result code
+ *
+ * Sends either a single LED packet for every key, or only the packets
+ * of the frame that hold the keys, whichever requires the fewest
+ * packets. The packets of the frame may only be used if the last frame
+ * sent is known, see libmk_invalidate_frame.
+ */
+int libmk_set_leds(LibMK_Handle* handle, const LibMK_KeyColor* keys, size_t n);
+
+/** @brief Internal function. libmk_set_leds with the handle locked */
+int libmk_send_leds(LibMK_Handle* handle, const LibMK_KeyColor* keys, size_t n);
+
 /** @brief Retrieve the addressing offset of a specific key
  *
  * @param offset: Pointer to unsigned char to store offset in
@@ -421,6 +1213,76 @@ int libmk_get_offset(
     unsigned char* offset, LibMK_Handle* handle,
     unsigned char row, unsigned char col);
 
+/** @brief Retrieve the key at a specific addressing offset
+ *
+ * @param handle: LibMK_Handle for the device to find the key for
+ * @param offset: Internal address of the key
+ * @param row: Pointer to store the zero-indexed row in
+ * @param col: Pointer to store the zero-indexed column in
+ * @returns LibMK_Result result code, LIBMK_ERR_INVALID_ARG if no key
+ *    has the offset
+ */
+int libmk_get_key(
+    LibMK_Handle* handle, unsigned char offset,
+    unsigned char* row, unsigned char* col);
+
+/** @brief Internal function. Build the scatter table of a handle
+ *
+ * @param handle: LibMK_Handle of which the layout and size are known
+ * @returns LibMK_Result result code
+ *
+ * Called by libmk_send_control_packet when the layout of the device
+ * has been read from the firmware. Sets the key map of the handle. If
+ * the layout is not supported, the table is left empty.
+ */
+int libmk_build_scatter(LibMK_Handle* handle);
+
+/** @brief Load key maps from a layouts file
+ *
+ * @param path: Path of the file, as written by libmk_write_layout
+ * @returns LibMK_Result result code
+ *
+ * The file is mapped into memory until libmk_exit. Its maps take
+ * precedence over the maps already known, and apply to handles of
+ * which control is enabled afterwards.
+ */
+int libmk_load_layouts(const char* path);
+
+/** @brief Write a key map to a layouts file
+ *
+ * @param path: Path of the file to write
+ * @param bDevice: USB Device ID the map applies to, 0 for any device
+ * @param layout: Layout the map applies to
+ * @param size: Size of keyboard the map applies to
+ * @param keys: Keys present on the keyboard
+ * @param num: Number of keys
+ * @returns LibMK_Result result code
+ */
+int libmk_write_layout(
+    const char* path, int bDevice, LibMK_Layout layout, LibMK_Size size,
+    const LibMK_Key* keys, int num);
+
+/** @brief Internal function. Find the key map for a keyboard
+ *
+ * @returns Map specific to the device if any, otherwise the map for
+ *    any device of the layout and size, or NULL if there is none
+ */
+const LibMK_KeyMap* libmk_find_keymap(
+    int bDevice, LibMK_Layout layout, LibMK_Size size);
+
+/** @brief Internal function. Build the indices of a key map
+ *
+ * @returns LibMK_Result result code, LIBMK_ERR_INVALID_ARG if a key is
+ *    out of bounds
+ */
+int libmk_index_keymap(LibMK_KeyMap* map);
+
+/** @brief Internal function. Index the built-in key maps */
+void libmk_init_keymaps(void);
+
+/** @brief Internal function. Free the key maps loaded from files */
+void libmk_clear_keymaps(void);
+
 /** @brief Set the profile active on the device
  *
  * @param handle: LibMK_Handle for the device to set the profile on. If
@@ -481,8 +1343,408 @@ int libmk_send_recv_packet(LibMK_Handle* handle, unsigned char* packet, bool r);
  *    otherwise this function will segfault.
  * @returns Pointer to the allocated packet with the set bytes. NULL if
  *    no memory could be allocated.
+ *
+ * The library itself encodes its packets into the buffers of the
+ * handle with the libmk_encode functions instead.
  */
 unsigned char* libmk_build_packet(unsigned char predef, ...);
 
+/** @brief Internal function. Clear a packet and set its first bytes */
+void libmk_encode_header(
+    unsigned char* packet, unsigned char header, unsigned char opcode);
+
+/** @brief Internal function. Encode a control mode packet */
+void libmk_encode_control_mode(unsigned char* packet, LibMK_ControlMode mode);
+
+/** @brief Internal function. Encode an effect packet */
+void libmk_encode_effect(unsigned char* packet, LibMK_Effect effect);
+
+/** @brief Internal function. Encode an effect packet with parameters */
+void libmk_encode_effect_details(
+    unsigned char* packet, LibMK_Effect_Details* effect);
+
+/** @brief Internal function. Encode a full keyboard color packet */
+void libmk_encode_full_color(
+    unsigned char* packet, unsigned char r, unsigned char g, unsigned char b);
+
+/** @brief Internal function. Encode a single LED color packet */
+void libmk_encode_single_led(
+    unsigned char* packet, unsigned char offset,
+    unsigned char r, unsigned char g, unsigned char b);
+
+/** @brief Internal function. Encode the header of an all LED packet */
+void libmk_encode_all_led(unsigned char* packet, unsigned char index);
+
+/** @brief Send multiple packets with several transfers in flight
+ *
+ * @param handle: LibMK_Handle of the device to send the packets to. If
+ *    NULL the global device handle is used.
+ * @param packets: Array of pointers to packets of LIBMK_PACKET_SIZE
+ * @param n: Number of packets in the array
+ * @param response_required: Whether a missing response is an error,
+ *    as in libmk_send_recv_packet.
+ * @param exchange: If true, the response to each packet is copied
+ *    into the buffer of that packet and the responses are not checked
+ *    for protocol errors, as in libmk_exch_packet.
+ * @returns LibMK_Result result code
+ *
+ * Uses the asynchronous libusb API to keep up to LIBMK_PIPELINE_DEPTH
+ * packets in flight, matching responses to packets as they arrive
+ * instead of waiting for each response before sending the next packet.
+ * The packets are sent in order. Upon the first error the remaining
+ * packets are not sent. If a transfer failed, all outstanding transfers
+ * are cancelled. After an error response, the responses to the packets
+ * already sent are still read, so they are not taken as responses to
+ * the packets of the next call.
+ * Does not free the memory of the packets. When responses are awaited
+ * is determined by the LibMK_AckPolicy of the handle.
+ */
+int libmk_send_packets(LibMK_Handle* handle, unsigned char** packets,
+                       int n, bool response_required, bool exchange);
+
+/** @brief Set the policy for awaiting the responses to packets
+ *
+ * @param handle: LibMK_Handle of the device to set the policy for. If
+ *    NULL the global device handle is used.
+ * @param policy: LibMK_AckPolicy to apply to all packets sent after
+ *    this call, except for those of which the response is read.
+ * @returns LibMK_Result result code
+ *
+ * Most packets are colour updates of which the response contains no
+ * information. With LIBMK_ACK_LAST, a batch of packets (such as a
+ * frame of libmk_set_all_led_color) only waits for the response to
+ * its last packet and the other packets are not limited by the speed
+ * with which the device answers. With LIBMK_ACK_DEFERRED, the calls
+ * return as soon as the packets have been sent. The responses are then
+ * read by a background thread and any error is returned by the next
+ * call. Switching away from LIBMK_ACK_DEFERRED waits for all
+ * outstanding responses.
+ */
+int libmk_set_ack_policy(LibMK_Handle* handle, LibMK_AckPolicy policy);
+
+/** @brief Recover from failed transfers by reopening the device
+ *
+ * @param handle: LibMK_Handle for the device to recover. If NULL uses
+ *    the global device handle.
+ * @param attempts: Maximum number of attempts to reopen the device
+ *    after a transfer failed, or 0 to disable recovery (default)
+ * @param backoff: Delay in microseconds before the first attempt,
+ *    which is doubled for every following attempt
+ * @returns LibMK_Result result code, LIBMK_ERR_UNSUPPORTED for handles
+ *    that do not control a USB device
+ *
+ * When a command fails with LIBMK_ERR_TRANSFER, the handle reopens
+ * the device found on the same port, claims the interface again and
+ * replays the last control mode, effect and frame known to be on the
+ * device. The command is then repeated. The error is only returned if
+ * all attempts fail. The duration of recoveries is recorded in
+ * LibMK_Stats.
+ */
+int libmk_set_recovery(
+    LibMK_Handle* handle, unsigned int attempts, unsigned int backoff);
+
+/** @brief Internal function. Reopen a device after a failed transfer
+ *
+ * Called with the command lock of the handle held. Returns the result
+ * of the last attempt.
+ */
+int libmk_recover(LibMK_Handle* handle);
+
+/** @brief Internal function. Open the device on the port of the handle
+ *
+ * Closes the current libusb handle and claims the interface on the
+ * device newly opened.
+ */
+int libmk_reopen(LibMK_Handle* handle);
+
+/** @brief Internal function. Send the state known to be on the device
+ *
+ * A valid shadow frame is sent with the custom effect, otherwise the
+ * control mode and effect are restored.
+ */
+int libmk_replay_state(LibMK_Handle* handle);
+
+/** @brief Wait for all outstanding responses of a device
+ *
+ * @param handle: LibMK_Handle of the device to wait for. If NULL the
+ *    global device handle is used.
+ * @returns LibMK_Result result code of the responses not yet reported
+ */
+int libmk_flush(LibMK_Handle* handle);
+
+/** @brief Internal function. Exchange packets with a specific policy */
+int libmk_run_pipeline(LibMK_Handle* handle, unsigned char** packets,
+                       int n, bool response_required, bool exchange,
+                       LibMK_AckPolicy policy);
+
+/** @brief Internal function. Submit the next packet of a batch */
+int libmk_submit_packet(LibMK_Handle* handle, int index, int n,
+                        bool response_required, bool exchange,
+                        LibMK_AckPolicy policy);
+
+/** @brief Internal function. Submit IN transfers for sent packets */
+void libmk_read_responses(LibMK_Handle* handle);
+
+/** @brief Internal function. Record an error of the pipeline
+ *
+ * LIBMK_ERR_TRANSFER marks the pipeline as failed, upon which its
+ * outstanding transfers are cancelled.
+ */
+void libmk_fail_pipeline(LibMK_Pipeline* pipeline, int result);
+
+/** @brief Internal function. Cancel all outstanding pipeline transfers */
+void libmk_cancel_pipeline(LibMK_Handle* handle);
+
+/** @brief Internal function. Cancel and await all pipeline transfers
+ *
+ * Called before the libusb handle is closed. Afterwards the pipeline
+ * is empty and none of the transfers refers to the handle.
+ */
+void libmk_drain_pipeline(LibMK_Handle* handle);
+
+/** @brief Internal function. libusb callback for OUT transfers */
+void libmk_out_callback(struct libusb_transfer* transfer);
+
+/** @brief Internal function. libusb callback for IN transfers */
+void libmk_in_callback(struct libusb_transfer* transfer);
+
+/** @brief Internal function. Start handling libusb events in a thread
+ *
+ * The thread is shared by all handles and reference counted. Each call
+ * must be matched by a call to libmk_stop_event_thread.
+ */
+int libmk_start_event_thread(void);
+
+/** @brief Internal function. Release the libusb event thread */
+void libmk_stop_event_thread(void);
+
+/** @brief Internal function. Handle libusb events until stopped */
+void* libmk_run_event_thread(void* arg);
+
+/** @brief Start a presentation thread for a device
+ *
+ * @param handle: LibMK_Handle for the device to present frames on. If
+ *    NULL the global device handle is used.
+ * @param rate: Target number of frames per second
+ * @returns LibMK_Result result code
+ *
+ * Frames posted with libmk_post_frame or libmk_post_full_color are
+ * sent to the device by the thread at most rate times per second.
+ * Frames that are replaced by a later frame before they are sent are
+ * dropped. While the thread is running, other functions may still be
+ * called on the handle, their commands are sent between the frames.
+ * The control mode must have been enabled.
+ */
+int libmk_start_presenter(LibMK_Handle* handle, unsigned int rate);
+
+/** @brief Stop the presentation thread of a device
+ *
+ * @param handle: LibMK_Handle for the device. If NULL the global
+ *    device handle is used.
+ * @returns LibMK_Result result code of the last frames sent, or
+ *    LIBMK_ERR_STILL_ACTIVE if the calling thread has locked the handle
+ *    with libmk_lock_handle, as the thread would wait for the lock
+ *
+ * A frame still waiting in the mailbox is dropped.
+ */
+int libmk_stop_presenter(LibMK_Handle* handle);
+
+/** @brief Post a frame to the presentation thread of a device
+ *
+ * @param handle: LibMK_Handle for the device. If NULL the global
+ *    device handle is used.
+ * @param colors: Frame as passed to libmk_set_all_led_color
+ * @returns LibMK_Result result code. Errors of frames sent earlier by
+ *    the thread are returned by the next call.
+ *
+ * Does not wait for the device and replaces any frame that has not yet
+ * been sent.
+ */
+int libmk_post_frame(LibMK_Handle* handle, unsigned char* colors);
+
+/** @brief Post a single color to the presentation thread of a device
+ *
+ * @param handle: LibMK_Handle for the device. If NULL the global
+ *    device handle is used.
+ * @param r: color byte red
+ * @param g: color byte green
+ * @param b: color byte blue
+ * @returns LibMK_Result result code, as for libmk_post_frame
+ *
+ * The color is set on all keys using libmk_set_full_color.
+ */
+int libmk_post_full_color(
+    LibMK_Handle* handle, unsigned char r, unsigned char g, unsigned char b);
+
+/** @brief Retrieve the number of frames presented per second
+ *
+ * @param handle: LibMK_Handle for the device. If NULL the global
+ *    device handle is used.
+ * @param fps: Pointer to store the frame rate achieved during the last
+ *    full second in. Drops to zero while no frames are posted.
+ * @returns LibMK_Result result code
+ */
+int libmk_get_presenter_fps(LibMK_Handle* handle, double* fps);
+
+/** @brief Internal function. Send the frames posted to a presenter */
+void* libmk_run_presenter(void* arg);
+
+/** @brief Internal function. Update the frame rate of a presenter
+ *
+ * Called with the lock of the presenter held. The rate is updated once
+ * a full second has passed since the last update, also if no frames
+ * were sent in the mean-time.
+ */
+void libmk_measure_presenter(LibMK_Presenter* presenter);
+
+/** @brief Retrieve the communication counters of a device
+ *
+ * @param handle: LibMK_Handle for the device. If NULL the global
+ *    device handle is used.
+ * @param stats: Pointer to LibMK_Stats to copy the counters to
+ * @returns LibMK_Result result code
+ *
+ * The counters are collected from the moment the handle was created
+ * or the last call to libmk_reset_stats.
+ */
+int libmk_get_stats(LibMK_Handle* handle, LibMK_Stats* stats);
+
+/** @brief Reset the communication counters of a device to zero
+ *
+ * @param handle: LibMK_Handle for the device. If NULL the global
+ *    device handle is used.
+ * @returns LibMK_Result result code
+ */
+int libmk_reset_stats(LibMK_Handle* handle);
+
+/** @brief Internal function. Current monotonic time in microseconds */
+unsigned long libmk_time_us(void);
+
+/** @brief Internal function. Add a latency to a histogram
+ *
+ * @param histogram: Array of LIBMK_LATENCY_BUCKETS counters
+ * @param latency: Latency in microseconds
+ */
+void libmk_record_latency(unsigned long* histogram, unsigned long latency);
+
+/** @brief Function executed for a device of a session
+ *
+ * @param handle: LibMK_Handle of the device
+ * @param arg: Argument for this device, see libmk_session_run
+ * @returns LibMK_Result result code
+ */
+typedef int (*LibMK_SessionJob)(LibMK_Handle* handle, void* arg);
+
+/** @brief Internal struct. I/O worker thread of a device in a session */
+typedef struct LibMK_Worker {
+    pthread_t thread; ///< Thread executing the jobs of the device
+    struct LibMK_Session* session; ///< Session the worker belongs to
+    LibMK_Handle* handle; ///< Handle of the device
+    void* arg; ///< Argument of the pending job
+    int result; ///< Result of the last job
+    bool pending; ///< Whether a job is waiting to be executed
+} LibMK_Worker;
+
+/** @brief Multiple keyboards controlled together
+ *
+ * Created by libmk_create_session. Owns a handle for every device and
+ * a worker thread for every handle, so that the commands sent to all
+ * devices are exchanged in parallel. The time taken by a command is
+ * the time of the slowest device rather than the sum of all devices.
+ */
+typedef struct LibMK_Session {
+    int num; ///< Number of devices in the session
+    LibMK_Handle** handles; ///< Handles of the devices
+    LibMK_Worker** workers; ///< Worker threads of the devices
+    pthread_mutex_t lock; ///< Protects the job of the session
+    pthread_cond_t work; ///< Signalled when jobs are submitted
+    pthread_cond_t done; ///< Signalled when a job is finished
+    LibMK_SessionJob job; ///< Job being executed
+    int remaining; ///< Number of workers still executing the job
+    bool exit; ///< Set to stop the workers
+} LibMK_Session;
+
+/** @brief Open a session for multiple devices
+ *
+ * @param session: Pointer to store the allocated session in
+ * @param devices: NULL-terminated array of LibMK_Device records, as
+ *    returned by libmk_detect, or NULL to create an empty session
+ * @returns LibMK_Result result code
+ *
+ * Every device is opened with libmk_open. Control must still be enabled
+ * with libmk_session_enable_control.
+ */
+int libmk_create_session(LibMK_Session** session, LibMK_Device** devices);
+
+/** @brief Add an opened handle to a session
+ *
+ * @param session: LibMK_Session to add the handle to
+ * @param handle: LibMK_Handle to add. The session takes ownership of
+ *    the handle and frees it in libmk_free_session.
+ * @returns LibMK_Result result code
+ *
+ * Must not be called while a job of the session is running.
+ */
+int libmk_session_add_handle(LibMK_Session* session, LibMK_Handle* handle);
+
+/** @brief Stop the workers of a session and free its handles
+ *
+ * @param session: LibMK_Session to free. Control of the devices must
+ *    have been disabled.
+ * @returns LibMK_Result result code
+ */
+int libmk_free_session(LibMK_Session* session);
+
+/** @brief Execute a function for every device of a session in parallel
+ *
+ * @param session: LibMK_Session of the devices
+ * @param job: Function to execute for every handle
+ * @param args: Array with an argument for every device, or NULL to
+ *    pass NULL to every call
+ * @param results: Array to store the result of every device in, may
+ *    be NULL
+ * @returns The first error of any device, LIBMK_SUCCESS otherwise
+ *
+ * Returns when the function has finished for all devices.
+ */
+int libmk_session_run(
+    LibMK_Session* session, LibMK_SessionJob job, void** args, int* results);
+
+/** @brief Enable control of all devices of a session */
+int libmk_session_enable_control(LibMK_Session* session);
+
+/** @brief Disable control of all devices of a session */
+int libmk_session_disable_control(LibMK_Session* session);
+
+/** @brief Set the same colors on all devices of a session
+ *
+ * @param session: LibMK_Session of the devices
+ * @param colors: Frame as passed to libmk_set_all_led_color
+ * @returns The first error of any device, LIBMK_SUCCESS otherwise
+ */
+int libmk_session_broadcast(LibMK_Session* session, unsigned char* colors);
+
+/** @brief Set different colors on every device of a session
+ *
+ * @param session: LibMK_Session of the devices
+ * @param frames: Array with a frame, as passed to
+ *    libmk_set_all_led_color, for every device in the order of the
+ *    handles of the session
+ * @returns The first error of any device, LIBMK_SUCCESS otherwise
+ */
+int libmk_session_scatter(LibMK_Session* session, unsigned char** frames);
+
+/** @brief Internal function. Execute the jobs of a session worker */
+void* libmk_run_worker(void* arg);
+
+/** @brief Internal function. LibMK_SessionJob of libmk_enable_control */
+int libmk_session_enable(LibMK_Handle* handle, void* arg);
+
+/** @brief Internal function. LibMK_SessionJob of libmk_disable_control */
+int libmk_session_disable(LibMK_Handle* handle, void* arg);
+
+/** @brief Internal function. LibMK_SessionJob of libmk_set_all_led_color */
+int libmk_session_set_frame(LibMK_Handle* handle, void* colors);
+
 /** Debugging purposes */
 void libmk_print_packet(unsigned char* packet, char* label);
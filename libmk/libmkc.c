@@ -3,14 +3,29 @@
  * License: GNU GPLv3
  * Copyright (c) 2018 RedFantom
 */
+#define _POSIX_C_SOURCE 200809L  // clock_gettime
 #include "libmkc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #define LIBMKC_DEBUG
 
+static LibMK_Pool InstructionPool = {
+    PTHREAD_MUTEX_INITIALIZER, NULL, NULL, sizeof(LibMK_Instruction)};
+static LibMK_Pool ColorsPool = {
+    PTHREAD_MUTEX_INITIALIZER, NULL, NULL,
+    LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3};
+static LibMK_Pool GeneratorPool = {
+    PTHREAD_MUTEX_INITIALIZER, NULL, NULL, sizeof(LibMK_Generator)};
+
 
 LibMK_Controller* libmk_create_controller(LibMK_Handle* handle) {
     LibMK_Controller* controller = (LibMK_Controller*) malloc(
@@ -21,8 +36,25 @@ LibMK_Controller* libmk_create_controller(LibMK_Handle* handle) {
     pthread_mutex_init(&controller->state_lock, NULL);
     pthread_mutex_init(&controller->exit_flag_lock, NULL);
     pthread_mutex_init(&controller->instr_lock, NULL);
+    pthread_mutex_init(&controller->sched_lock, NULL);
+    pthread_mutex_init(&controller->cancel_lock, NULL);
+    pthread_mutex_init(&controller->stats_lock, NULL);
     pthread_mutex_init(&controller->error_lock, NULL);
-    controller->instr = NULL;
+    // Instruction durations must not be affected by changes of the system time
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&controller->instr_cond, &attr);
+    pthread_cond_init(&controller->state_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    controller->error = LIBMK_SUCCESS;
+    controller->head = 0;
+    controller->tail = 0;
+    controller->last_id = 0;
+    controller->stream_end = 0;
+    memset(&controller->stats, 0, sizeof(LibMK_Controller_Stats));
+    controller->done_id = 0;
+    controller->num_cancelled = 0;
     controller->state = LIBMK_STATE_PRESTART;
     controller->exit_flag = false;
     controller->wait_flag = false;
@@ -49,10 +81,23 @@ LibMK_Result libmk_get_controller_error(LibMK_Controller* c) {
 LibMK_Result libmk_free_controller(LibMK_Controller* c) {
     if (libmk_get_controller_state(c) == LIBMK_STATE_ACTIVE)
         return LIBMK_ERR_STILL_ACTIVE;
+    // Instructions that were not executed are freed with the controller
+    LibMK_Instruction* pending = NULL;
+    for (; c->head != c->tail; c->tail--) {
+        LibMK_Instruction* i = c->queue[(c->tail - 1) % LIBMKC_QUEUE_SIZE];
+        i->next = pending;
+        pending = i;
+    }
+    libmk_free_instructions(pending);
     pthread_mutex_destroy(&c->state_lock);
     pthread_mutex_destroy(&c->exit_flag_lock);
     pthread_mutex_destroy(&c->instr_lock);
+    pthread_mutex_destroy(&c->sched_lock);
+    pthread_mutex_destroy(&c->cancel_lock);
+    pthread_mutex_destroy(&c->stats_lock);
     pthread_mutex_destroy(&c->error_lock);
+    pthread_cond_destroy(&c->instr_cond);
+    pthread_cond_destroy(&c->state_cond);
     int r = libmk_free_handle(c->handle);
     if (r != LIBMK_SUCCESS)
         return (LibMK_Result) r;
@@ -66,57 +111,176 @@ LibMK_Result libmk_start_controller(LibMK_Controller* controller) {
     LibMK_Result r = (LibMK_Result) libmk_enable_control(controller->handle);
     if (r != LIBMK_SUCCESS)
         return r;
-    pthread_create(
-        &controller->thread, NULL,
-        (void*) libmk_run_controller, (void*) controller);
+    // Active before the thread runs, so a join cannot return early
+    pthread_mutex_lock(&(controller->state_lock));
+    controller->state = LIBMK_STATE_ACTIVE;
+    pthread_mutex_unlock(&(controller->state_lock));
+    if (pthread_create(
+            &controller->thread, NULL,
+            (void*) libmk_run_controller, (void*) controller) != 0) {
+        pthread_mutex_lock(&(controller->state_lock));
+        controller->state = LIBMK_STATE_START_ERR;
+        pthread_mutex_unlock(&(controller->state_lock));
+        libmk_disable_control(controller->handle);
+        return LIBMK_ERR_THREAD;
+    }
     return LIBMK_SUCCESS;
 }
 
 
+bool libmk_controller_exiting(LibMK_Controller* c, bool idle) {
+    pthread_mutex_lock(&(c->exit_flag_lock));
+    bool exiting = c->exit_flag || (idle && c->wait_flag);
+    pthread_mutex_unlock(&(c->exit_flag_lock));
+    return exiting;
+}
+
+
 void libmk_run_controller(LibMK_Controller* controller) {
-    pthread_mutex_lock(&(controller->state_lock));
-    controller->state = LIBMK_STATE_ACTIVE;
-    pthread_mutex_unlock(&(controller->state_lock));
-    bool exit_flag, wait_flag;
+    unsigned long start = 0; // Start of the current stream
+    unsigned long next = libmk_time_us(); // End of the last instruction
+    LibMK_Instruction* retired = NULL; // Instructions done with
+    unsigned int num_retired = 0;
     while (true) {
-        pthread_mutex_lock(&(controller->exit_flag_lock));
-        exit_flag = controller->exit_flag;
-        wait_flag = controller->wait_flag;
-        pthread_mutex_unlock(&(controller->exit_flag_lock));
-        if (exit_flag)
+        unsigned int tail = __atomic_load_n(&controller->tail, __ATOMIC_ACQUIRE);
+        bool idle = controller->head == tail;
+        // Freed in batches, and before sleeping without instructions
+        if (num_retired == LIBMKC_RETIRE_BATCH || (idle && retired != NULL)) {
+            libmk_free_instructions(retired);
+            retired = NULL;
+            num_retired = 0;
+        }
+        if (libmk_controller_exiting(controller, idle && libmk_time_us() >= next))
             break;
-        pthread_mutex_lock(&(controller->instr_lock));
-        if (controller->instr == NULL) {
+        if (idle) {
+            // The duration of the last instruction runs out first
+            if (libmk_time_us() < next) {
+                libmk_sleep_controller(controller, next, false);
+                continue;
+            }
+            // Schedulers signal with instr_lock held, after publishing
+            pthread_mutex_lock(&(controller->instr_lock));
+            if (controller->head == __atomic_load_n(
+                        &controller->tail, __ATOMIC_ACQUIRE) &&
+                    !libmk_controller_exiting(controller, true))
+                pthread_cond_wait(
+                    &(controller->instr_cond), &(controller->instr_lock));
             pthread_mutex_unlock(&(controller->instr_lock));
-            if (wait_flag)
-                break;
-            usleep(1000);
             continue;
         }
-        LibMK_Result r = (LibMK_Result) libmk_exec_instruction(
-            controller->handle, controller->instr);
+        LibMK_Instruction* instr =
+            controller->queue[controller->head % LIBMKC_QUEUE_SIZE];
+        __atomic_store_n(&controller->done_id, instr->id, __ATOMIC_RELEASE);
+        __atomic_store_n(&controller->head, controller->head + 1, __ATOMIC_RELEASE);
+        instr->next = retired;
+        retired = instr;
+        num_retired++;
+        if (libmk_take_cancelled(controller, instr->id))
+            continue;
+
+        unsigned long now = libmk_time_us();
+        if (instr->deadline == 0) {
+            // A stream scheduled in time continues where the last ended
+            start = next > now ? next : now;
+            pthread_mutex_lock(&(controller->stats_lock));
+            controller->stats.streams++;
+            pthread_mutex_unlock(&(controller->stats_lock));
+        }
+        unsigned long due = start + instr->deadline;
+        next = due + instr->duration;
+        // Frames replace all colors, so a late one may be skipped if
+        // the next instruction is a frame that is also due already
+        bool frame = instr->type == LIBMK_INSTR_FULL ||
+            instr->type == LIBMK_INSTR_ALL;
+        if (frame && now >= next && controller->head != tail) {
+            LibMK_Instruction* following =
+                controller->queue[controller->head % LIBMKC_QUEUE_SIZE];
+            if (following->type != LIBMK_INSTR_SINGLE) {
+                libmk_record_drop(controller, 1);
+                continue;
+            }
+        }
+        libmk_sleep_controller(controller, due, false);
+        if (libmk_controller_exiting(controller, false))
+            break;
+
+        LibMK_Result r;
+        if (instr->type == LIBMK_INSTR_CLIP) {
+            r = libmk_play_clip(controller, instr->data.clip, due);
+        } else if (instr->type == LIBMK_INSTR_EFFECT) {
+            r = libmk_play_effect(
+                controller, instr->data.effect, due, instr->duration);
+        } else {
+            libmk_record_execution(controller, due);
+            r = (LibMK_Result) libmk_exec_instruction(controller->handle, instr);
+        }
         if (r != LIBMK_SUCCESS) {
             libmk_set_controller_error(controller, r);
-            pthread_mutex_unlock(&(controller->instr_lock));
             break;
         }
-        usleep(controller->instr->duration);
-        // Move on to next instruction
-        LibMK_Instruction* old = controller->instr;
-        controller->instr = controller->instr->next;
-        libmk_free_instruction(old);
-        pthread_mutex_unlock(&(controller->instr_lock));
     }
+    libmk_free_instructions(retired);
     int r = libmk_disable_control(controller->handle);
     if (r != LIBMK_SUCCESS) {
         libmk_set_controller_error(controller, (LibMK_Result) r);
     }
     pthread_mutex_lock(&(controller->state_lock));
     controller->state = LIBMK_STATE_STOPPED;
+    pthread_cond_broadcast(&(controller->state_cond));
     pthread_mutex_unlock(&(controller->state_lock));
 }
 
 
+void libmk_record_execution(LibMK_Controller* c, unsigned long due) {
+    unsigned long now = libmk_time_us();
+    unsigned long jitter = now > due ? now - due : 0;
+    pthread_mutex_lock(&(c->stats_lock));
+    c->stats.executed++;
+    libmk_record_latency(c->stats.jitter, jitter);
+    if (jitter > c->stats.max_jitter)
+        c->stats.max_jitter = jitter;
+    pthread_mutex_unlock(&(c->stats_lock));
+}
+
+
+void libmk_record_drop(LibMK_Controller* c, unsigned long n) {
+    pthread_mutex_lock(&(c->stats_lock));
+    c->stats.dropped += n;
+    pthread_mutex_unlock(&(c->stats_lock));
+}
+
+
+bool libmk_controller_preempted(LibMK_Controller* c) {
+    // Once asked to finish, an empty queue does not get any new work
+    return c->head != __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) ||
+           libmk_controller_exiting(c, true);
+}
+
+
+void libmk_sleep_controller(
+        LibMK_Controller* c, unsigned long until, bool preempt) {
+    struct timespec deadline;
+    deadline.tv_sec = until / 1000000;
+    deadline.tv_nsec = (long) (until % 1000000) * 1000;
+    // Only an exit request, or a new instruction if asked, ends it early
+    pthread_mutex_lock(&(c->instr_lock));
+    while (!libmk_controller_exiting(c, false) &&
+           !(preempt && libmk_controller_preempted(c)) &&
+           pthread_cond_timedwait(
+               &(c->instr_cond), &(c->instr_lock), &deadline) != ETIMEDOUT);
+    pthread_mutex_unlock(&(c->instr_lock));
+}
+
+
+LibMK_Result libmk_get_controller_stats(
+        LibMK_Controller* c, LibMK_Controller_Stats* stats) {
+    pthread_mutex_lock(&(c->stats_lock));
+    memcpy(stats, &(c->stats), sizeof(LibMK_Controller_Stats));
+    pthread_mutex_unlock(&(c->stats_lock));
+    return LIBMK_SUCCESS;
+}
+
+
 void libmk_set_controller_error(LibMK_Controller* c, LibMK_Result e) {
     pthread_mutex_lock(&(c->error_lock));
     if (c->error == LIBMK_SUCCESS)
@@ -129,65 +293,164 @@ LibMK_Result libmk_exec_instruction(LibMK_Handle* h, LibMK_Instruction* i) {
     if (i == NULL)
         return libmk_send_control_packet(h);
     else if (i->type == LIBMK_INSTR_ALL) {
-        return libmk_set_all_led_color(h, i->colors);
+        return libmk_set_all_led_color(h, i->data.colors);
     } else if (i->type == LIBMK_INSTR_FULL) {
-        return libmk_set_full_color(h, i->color[0], i->color[1], i->color[2]);
+        unsigned char* color = i->data.color;
+        return libmk_set_full_color(h, color[0], color[1], color[2]);
     } else if (i->type == LIBMK_INSTR_SINGLE) {
+        unsigned char* color = i->data.single.color;
         return libmk_set_single_led(
-            h, i->r, i->c, i->color[0], i->color[1], i->color[2]);
+            h, i->data.single.r, i->data.single.c,
+            color[0], color[1], color[2]);
     }
+    // Clips are only played by a Controller, which keeps their timing
+    return LIBMK_ERR_INVALID_ARG;
 }
 
 
 void libmk_stop_controller(LibMK_Controller* controller) {
+    pthread_mutex_lock(&(controller->instr_lock));
     pthread_mutex_lock(&(controller->exit_flag_lock));
     controller->exit_flag = true;
     pthread_mutex_unlock(&(controller->exit_flag_lock));
+    pthread_cond_signal(&(controller->instr_cond));
+    pthread_mutex_unlock(&(controller->instr_lock));
 }
 
 
 void libmk_wait_controller(LibMK_Controller* controller) {
+    pthread_mutex_lock(&(controller->instr_lock));
     pthread_mutex_lock(&(controller->exit_flag_lock));
     controller->wait_flag = true;
     pthread_mutex_unlock(&(controller->exit_flag_lock));
+    pthread_cond_signal(&(controller->instr_cond));
+    pthread_mutex_unlock(&(controller->instr_lock));
 }
 
 
 LibMK_Controller_State libmk_join_controller(
         LibMK_Controller* controller, double timeout) {
-    LibMK_Controller_State s;
-    clock_t t = clock();
-    double elapsed;
-    while (true) {
-        pthread_mutex_lock(&(controller->state_lock));
-        s = controller->state;
-        pthread_mutex_unlock(&(controller->state_lock));
-        if (s != LIBMK_STATE_ACTIVE)
-            break;
-        elapsed = ((double) (clock() - t)) / CLOCKS_PER_SEC;
-        if (elapsed > timeout)
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t) timeout;
+    deadline.tv_nsec += (long) ((timeout - (time_t) timeout) * 1e9);
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_mutex_lock(&(controller->state_lock));
+    while (controller->state == LIBMK_STATE_ACTIVE) {
+        if (pthread_cond_timedwait(
+                &(controller->state_cond), &(controller->state_lock),
+                &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&(controller->state_lock));
             return LIBMK_STATE_JOIN_ERR;
+        }
     }
+    LibMK_Controller_State s = controller->state;
+    pthread_mutex_unlock(&(controller->state_lock));
     return s;
 }
 
 
+void* libmk_pool_alloc(LibMK_Pool* pool) {
+    pthread_mutex_lock(&(pool->lock));
+    if (pool->free == NULL) {
+        // Slabs start with a pointer to the next slab
+        size_t size = (pool->size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+        unsigned char* slab = (unsigned char*) malloc(
+            sizeof(void*) + size * LIBMKC_SLAB_SIZE);
+        if (slab == NULL) {
+            pthread_mutex_unlock(&(pool->lock));
+            return NULL;
+        }
+        *(void**) slab = pool->slabs;
+        pool->slabs = slab;
+        for (int j = LIBMKC_SLAB_SIZE - 1; j >= 0; j--) {
+            void* block = slab + sizeof(void*) + j * size;
+            *(void**) block = pool->free;
+            pool->free = block;
+        }
+    }
+    void* block = pool->free;
+    pool->free = *(void**) block;
+    pthread_mutex_unlock(&(pool->lock));
+    return block;
+}
+
+
+void libmk_pool_release(LibMK_Pool* pool, void* first, void* last) {
+    pthread_mutex_lock(&(pool->lock));
+    *(void**) last = pool->free;
+    pool->free = first;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+
+void libmk_clear_instruction_pools(void) {
+    LibMK_Pool* pools[3] = {&InstructionPool, &ColorsPool, &GeneratorPool};
+    for (int p = 0; p < 3; p++) {
+        pthread_mutex_lock(&(pools[p]->lock));
+        while (pools[p]->slabs != NULL) {
+            void* slab = pools[p]->slabs;
+            pools[p]->slabs = *(void**) slab;
+            free(slab);
+        }
+        pools[p]->free = NULL;
+        pthread_mutex_unlock(&(pools[p]->lock));
+    }
+}
+
+
 void libmk_free_instruction(LibMK_Instruction* i) {
-    fflush(stdout);
-    if (i->colors != NULL)
-        free(i->colors);
-    free(i);
+    i->next = NULL;
+    libmk_free_instructions(i);
+}
+
+
+void libmk_free_instructions(LibMK_Instruction* i) {
+    if (i == NULL)
+        return;
+    // Link the blocks into lists first to release each list at once
+    void* first[2] = {NULL, NULL};
+    void* last[2] = {NULL, NULL};
+    LibMK_Instruction* last_instr = i;
+    for (LibMK_Instruction* k = i; k != NULL; k = k->next) {
+        last_instr = k;
+        int p;
+        void* block;
+        if (k->type == LIBMK_INSTR_ALL && k->data.colors != NULL) {
+            p = 0;
+            block = k->data.colors;
+        } else if (k->type == LIBMK_INSTR_EFFECT && k->data.effect != NULL) {
+            p = 1;
+            block = k->data.effect;
+        } else {
+            continue;
+        }
+        *(void**) block = first[p];
+        if (first[p] == NULL)
+            last[p] = block;
+        first[p] = block;
+    }
+    if (first[0] != NULL)
+        libmk_pool_release(&ColorsPool, first[0], last[0]);
+    if (first[1] != NULL)
+        libmk_pool_release(&GeneratorPool, first[1], last[1]);
+    // The next attribute is the first member, so the list is linked
+    libmk_pool_release(&InstructionPool, i, last_instr);
 }
 
 
 LibMK_Instruction* libmk_create_instruction() {
     LibMK_Instruction* i =
-        (LibMK_Instruction*) malloc(sizeof(LibMK_Instruction));
+        (LibMK_Instruction*) libmk_pool_alloc(&InstructionPool);
+    if (i == NULL)
+        return NULL;
     i->duration = 0;
+    i->deadline = 0;
     i->id = -1;
     i->type = -1;
     i->next = NULL;
-    i->colors = NULL;
+    i->data.colors = NULL;
     return i;
 }
 
@@ -195,19 +458,21 @@ LibMK_Instruction* libmk_create_instruction() {
 LibMK_Instruction* libmk_create_instruction_single(
         unsigned char row, unsigned char column, unsigned char color[3]) {
     LibMK_Instruction* i = libmk_create_instruction();
+    if (i == NULL)
+        return NULL;
     i->type = LIBMK_INSTR_SINGLE;
-    for (unsigned char j=0; j<3; j++)
-        i->color[j] = color[j];
-    i->r = row;
-    i->c = column;
+    memcpy(i->data.single.color, color, 3);
+    i->data.single.r = row;
+    i->data.single.c = column;
     return i;
 }
 
 
 LibMK_Instruction* libmk_create_instruction_full(unsigned char c[3]) {
     LibMK_Instruction* i = libmk_create_instruction();
-    for (unsigned char j=0; j<3; j++)
-        i->color[j] = c[j];
+    if (i == NULL)
+        return NULL;
+    memcpy(i->data.color, c, 3);
     i->type = LIBMK_INSTR_FULL;
     return i;
 }
@@ -216,9 +481,14 @@ LibMK_Instruction* libmk_create_instruction_full(unsigned char c[3]) {
 LibMK_Instruction* libmk_create_instruction_all(
         unsigned char c[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]) {
     LibMK_Instruction* i = libmk_create_instruction();
-    i->colors = (unsigned char*) malloc(
-        sizeof(unsigned char) * LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3);
-    memcpy(i->colors, c, LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3);
+    if (i == NULL)
+        return NULL;
+    i->data.colors = (unsigned char*) libmk_pool_alloc(&ColorsPool);
+    if (i->data.colors == NULL) {
+        libmk_free_instruction(i);
+        return NULL;
+    }
+    memcpy(i->data.colors, c, LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3);
     i->type = LIBMK_INSTR_ALL;
     return i;
 }
@@ -226,83 +496,503 @@ LibMK_Instruction* libmk_create_instruction_all(
 
 LibMK_Instruction* libmk_create_instruction_flash(
         unsigned char c[3], unsigned int delay, unsigned char n) {
-    unsigned char color[3] = {0};
-    LibMK_Instruction* i = libmk_create_instruction_full(color);
-    LibMK_Instruction* k = i;
-    LibMK_Instruction* l;
-    for (unsigned char j=0; j<n; j++) {
-        color[0] = ((double) j / (double) n) * c[0];
-        color[1] = ((double) j / (double) n) * c[1];
-        color[2] = ((double) j / (double) n) * c[2];
-        l = libmk_create_instruction_full(color);
-        l->duration = delay;
-        k->next = l;
-        k = l;
-    }
-    for (unsigned char j=n; j>0; j--) {
-        color[0] = ((double) j / (double) n) * c[0];
-        color[1] = ((double) j / (double) n) * c[1];
-        color[2] = ((double) j / (double) n) * c[2];
-        l = libmk_create_instruction_full(color);
-        l->duration = delay;
-        k->next = l;
-        k = l;
+    LibMK_Generator g;
+    memset(&g, 0, sizeof(g));
+    g.kernel = libmk_kernel_flash;
+    g.uniform = true;
+    memcpy(g.from, c, 3);
+    g.period = 2 * n * delay;
+    g.interval = delay;
+    // Without any steps a single black frame is shown, a duration of
+    // zero would keep the effect running until the next instruction
+    return libmk_create_instruction_effect(&g, g.period != 0 ? g.period : 1);
+}
+
+
+LibMK_Instruction* libmk_create_instruction_effect(
+        const LibMK_Generator* g, unsigned int duration) {
+    LibMK_Instruction* i = libmk_create_instruction();
+    if (i == NULL)
+        return NULL;
+    i->data.effect = (LibMK_Generator*) libmk_pool_alloc(&GeneratorPool);
+    if (i->data.effect == NULL) {
+        libmk_free_instruction(i);
+        return NULL;
     }
+    memcpy(i->data.effect, g, sizeof(LibMK_Generator));
+    i->duration = duration;
+    i->type = LIBMK_INSTR_EFFECT;
     return i;
 }
 
 
+LibMK_Instruction* libmk_create_instruction_fade(
+        unsigned char from[3], unsigned char to[3],
+        unsigned int period, unsigned int duration) {
+    LibMK_Generator g;
+    memset(&g, 0, sizeof(g));
+    g.kernel = libmk_kernel_fade;
+    g.uniform = true;
+    memcpy(g.from, from, 3);
+    memcpy(g.to, to, 3);
+    g.period = period;
+    return libmk_create_instruction_effect(&g, duration);
+}
+
+
+LibMK_Instruction* libmk_create_instruction_breathe(
+        unsigned char c[3], unsigned int period, unsigned int duration) {
+    LibMK_Generator g;
+    memset(&g, 0, sizeof(g));
+    g.kernel = libmk_kernel_breathe;
+    g.uniform = true;
+    memcpy(g.from, c, 3);
+    g.period = period;
+    return libmk_create_instruction_effect(&g, duration);
+}
+
+
+LibMK_Instruction* libmk_create_instruction_wave(
+        unsigned int period, unsigned int width, unsigned int duration) {
+    LibMK_Generator g;
+    memset(&g, 0, sizeof(g));
+    g.kernel = libmk_kernel_wave;
+    g.period = period;
+    g.width = width;
+    return libmk_create_instruction_effect(&g, duration);
+}
+
+
+LibMK_Instruction* libmk_create_instruction_sweep(
+        unsigned char from[3], unsigned char to[3],
+        unsigned int period, unsigned int width, unsigned int duration) {
+    LibMK_Generator g;
+    memset(&g, 0, sizeof(g));
+    g.kernel = libmk_kernel_sweep;
+    memcpy(g.from, from, 3);
+    memcpy(g.to, to, 3);
+    g.period = period;
+    g.width = width;
+    return libmk_create_instruction_effect(&g, duration);
+}
+
+
+unsigned int libmk_phase(unsigned long t, unsigned int period) {
+    if (period == 0)
+        return 255;
+    return (unsigned int) ((unsigned long long) (t % period) * 256 / period);
+}
+
+
+unsigned int libmk_column_phase(unsigned char col, unsigned int width) {
+    if (width == 0)
+        width = LIBMK_MAX_COLS;
+    return (col % width) * 256 / width;
+}
+
+
+unsigned int libmk_triangle(unsigned int phase) {
+    return phase < 128 ? phase * 2 : (255 - phase) * 2;
+}
+
+
+void libmk_mix_colors(
+        const unsigned char* a, const unsigned char* b, unsigned int weight,
+        unsigned char* color) {
+    for (int j = 0; j < 3; j++)
+        color[j] = (unsigned char) ((a[j] * (255 - weight) + b[j] * weight) / 255);
+}
+
+
+void libmk_kernel_flash(
+        const LibMK_Generator* g, unsigned long t,
+        unsigned char row, unsigned char col, unsigned char* color) {
+    unsigned char black[3] = {0};
+    libmk_mix_colors(black, g->from, libmk_triangle(libmk_phase(t, g->period)), color);
+}
+
+
+void libmk_kernel_fade(
+        const LibMK_Generator* g, unsigned long t,
+        unsigned char row, unsigned char col, unsigned char* color) {
+    if (t >= g->period) {
+        memcpy(color, g->to, 3);
+        return;
+    }
+    libmk_mix_colors(g->from, g->to, libmk_phase(t, g->period), color);
+}
+
+
+void libmk_kernel_breathe(
+        const LibMK_Generator* g, unsigned long t,
+        unsigned char row, unsigned char col, unsigned char* color) {
+    // Smoothstep of the triangle, so the brightness eases in and out
+    unsigned int x = libmk_triangle(libmk_phase(t, g->period));
+    unsigned int weight = x * x * (3 * 255 - 2 * x) / (255 * 255);
+    libmk_mix_colors(g->to, g->from, weight, color);
+}
+
+
+void libmk_kernel_wave(
+        const LibMK_Generator* g, unsigned long t,
+        unsigned char row, unsigned char col, unsigned char* color) {
+    /** HSV to RGB conversion at full saturation and value
+     *
+     * The conversion algorithm was copied from:
+     *    https://stackoverflow.com/questions/3018313
+     *    The answer by Leszek Szary
+     */
+    unsigned int hue =
+        (libmk_phase(t, g->period) + libmk_column_phase(col, g->width)) & 0xFF;
+    unsigned char region = hue / 43;
+    unsigned char remainder = (hue - (region * 43)) * 6;
+    unsigned char q = (255 * (255 - remainder)) >> 8;
+    unsigned char u = (255 * remainder) >> 8;
+    unsigned char rgb[6][3] = {
+        {255, u, 0}, {q, 255, 0}, {0, 255, u},
+        {0, q, 255}, {u, 0, 255}, {255, 0, q}};
+    memcpy(color, rgb[region], 3);
+}
+
+
+void libmk_kernel_sweep(
+        const LibMK_Generator* g, unsigned long t,
+        unsigned char row, unsigned char col, unsigned char* color) {
+    unsigned int phase =
+        (libmk_phase(t, g->period) + libmk_column_phase(col, g->width)) & 0xFF;
+    libmk_mix_colors(g->from, g->to, libmk_triangle(phase), color);
+}
+
+
 int libmk_sched_instruction(
         LibMK_Controller* c, LibMK_Instruction* i) {
-    pthread_mutex_lock(&(c->instr_lock));
     if (i->id != -1)
         return LIBMK_ERR_INVALID_ARG; // Instruction already scheduled!
-    if (c->instr == NULL) {
-        c->instr = i;
-        c->instr->id = 1;
-    } else {
-        LibMK_Instruction* t = c->instr;
-        while (t != NULL) {
-            if (t->next == NULL) {
-                t->next = i;
-                t->next->id = t->id + 1;
-                break;
-            }
-            t = t->next;
-        }
+    unsigned int n = 0;
+    for (LibMK_Instruction* k = i; k != NULL; k = k->next)
+        n++;
+    // A list longer than the queue would never fit
+    if (n > LIBMKC_QUEUE_SIZE)
+        return LIBMK_ERR_INVALID_ARG;
+    pthread_mutex_lock(&(c->sched_lock));
+    unsigned int head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    if (c->tail - head + n > LIBMKC_QUEUE_SIZE) {
+        pthread_mutex_unlock(&(c->sched_lock));
+        return LIBMK_ERR_QUEUE_FULL;
     }
-    if (i->next != NULL) {
-        LibMK_Instruction *k = i->next;
-        unsigned int id = i->id;
-        while (k != NULL) {
-            id += 1;
-            k->id = id;
-            k = k->next;
-        }
+    int first_id = c->last_id + 1;
+    unsigned int tail = c->tail;
+    // Instructions scheduled after the queue ran empty start a new stream
+    if (tail == head)
+        c->stream_end = 0;
+    LibMK_Instruction* next;
+    for (LibMK_Instruction* k = i; k != NULL; k = next) {
+        next = k->next;
+        k->next = NULL;
+        k->id = ++c->last_id;
+        k->deadline = c->stream_end;
+        c->stream_end += k->duration;
+        c->queue[tail++ % LIBMKC_QUEUE_SIZE] = k;
     }
-    int first_id = i->id;
+    __atomic_store_n(&c->tail, tail, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&(c->sched_lock));
+
+    pthread_mutex_lock(&(c->instr_lock));
+    pthread_cond_signal(&(c->instr_cond));
     pthread_mutex_unlock(&(c->instr_lock));
     return first_id;
 }
 
 
 LibMK_Result libmk_cancel_instruction(LibMK_Controller* c, unsigned int id) {
-    pthread_mutex_lock(&(c->instr_lock));
-    LibMK_Instruction* prev = NULL;
-    LibMK_Instruction* curr = c->instr;
-    while (curr != NULL) {
-        if (curr->id == id) {
-            // Cancel this instruction
-            if (prev != NULL)
-                prev->next = curr->next;
-            else  // First instruction in Linked List
-                c->instr = curr->next;
-            libmk_free_instruction(curr);
+    pthread_mutex_lock(&(c->sched_lock));
+    bool scheduled = id > 0 && id <= c->last_id;
+    pthread_mutex_unlock(&(c->sched_lock));
+    if (!scheduled || id <= __atomic_load_n(&c->done_id, __ATOMIC_ACQUIRE))
+        return LIBMK_SUCCESS;
+    pthread_mutex_lock(&(c->cancel_lock));
+    if (c->num_cancelled == LIBMKC_CANCEL_MAX) {
+        pthread_mutex_unlock(&(c->cancel_lock));
+        return LIBMK_ERR_QUEUE_FULL;
+    }
+    c->cancelled[c->num_cancelled] = id;
+    __atomic_store_n(&c->num_cancelled, c->num_cancelled + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&(c->cancel_lock));
+    return LIBMK_SUCCESS;
+}
+
+
+bool libmk_take_cancelled(LibMK_Controller* c, unsigned int id) {
+    if (__atomic_load_n(&c->num_cancelled, __ATOMIC_ACQUIRE) == 0)
+        return false;
+    bool found = false;
+    pthread_mutex_lock(&(c->cancel_lock));
+    // IDs are taken off the ring in order, so smaller IDs have passed
+    for (unsigned int j = 0; j < c->num_cancelled;) {
+        if (c->cancelled[j] > id) {
+            j++;
+            continue;
+        }
+        found = found || c->cancelled[j] == id;
+        c->cancelled[j] = c->cancelled[c->num_cancelled - 1];
+        __atomic_store_n(&c->num_cancelled, c->num_cancelled - 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&(c->cancel_lock));
+    return found;
+}
+
+
+unsigned int libmk_get_queue_depth(LibMK_Controller* c) {
+    return __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+}
+
+
+LibMK_Instruction* libmk_create_instruction_clip(const LibMK_Clip* clip) {
+    LibMK_Instruction* i = libmk_create_instruction();
+    if (i == NULL)
+        return NULL;
+    i->data.clip = clip;
+    i->duration = clip->duration > UINT_MAX ? UINT_MAX : clip->duration;
+    i->type = LIBMK_INSTR_CLIP;
+    return i;
+}
+
+
+LibMK_Result libmk_open_clip(
+        const unsigned char* data, size_t length, LibMK_Clip** clip) {
+    const LibMK_ClipHeader* header = (const LibMK_ClipHeader*) data;
+    if (length < sizeof(LibMK_ClipHeader) ||
+            memcmp(header->magic, LIBMKC_CLIP_MAGIC, 4) != 0 ||
+            header->version != LIBMKC_CLIP_VERSION)
+        return LIBMK_ERR_FILE;
+    // All frames are checked here so that playing needs no checks
+    size_t position = sizeof(LibMK_ClipHeader);
+    unsigned long duration = 0;
+    for (unsigned int f = 0; f < header->num_frames; f++) {
+        if (length - position < sizeof(LibMK_ClipFrame))
+            return LIBMK_ERR_FILE;
+        const LibMK_ClipFrame* frame = (const LibMK_ClipFrame*) (data + position);
+        position += sizeof(LibMK_ClipFrame);
+        if (frame->keyframe) {
+            if (length - position < LIBMKC_CLIP_KEYFRAME_SIZE)
+                return LIBMK_ERR_FILE;
+            position += LIBMKC_CLIP_KEYFRAME_SIZE;
+        } else {
+            // The colors start undefined until the first keyframe
+            if (f == 0 || length - position < frame->num * sizeof(LibMK_ClipDelta))
+                return LIBMK_ERR_FILE;
+            const LibMK_ClipDelta* deltas = (const LibMK_ClipDelta*) (data + position);
+            for (unsigned short d = 0; d < frame->num; d++)
+                if (deltas[d].key >= LIBMK_MAX_ROWS * LIBMK_MAX_COLS)
+                    return LIBMK_ERR_FILE;
+            position += frame->num * sizeof(LibMK_ClipDelta);
+        }
+        duration += frame->duration;
+    }
+    *clip = (LibMK_Clip*) malloc(sizeof(LibMK_Clip));
+    if (*clip == NULL)
+        return LIBMK_ERR_NO_MEMORY;
+    (*clip)->frames = data + sizeof(LibMK_ClipHeader);
+    (*clip)->length = position - sizeof(LibMK_ClipHeader);
+    (*clip)->num_frames = header->num_frames;
+    (*clip)->duration = duration;
+    (*clip)->mapping = NULL;
+    (*clip)->mapped = 0;
+    return LIBMK_SUCCESS;
+}
+
+
+LibMK_Result libmk_load_clip(const char* path, LibMK_Clip** clip) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return LIBMK_ERR_FILE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return LIBMK_ERR_FILE;
+    }
+    size_t length = (size_t) st.st_size;
+    void* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return LIBMK_ERR_FILE;
+    LibMK_Result r = libmk_open_clip((const unsigned char*) data, length, clip);
+    if (r != LIBMK_SUCCESS) {
+        munmap(data, length);
+        return r;
+    }
+    (*clip)->mapping = data;
+    (*clip)->mapped = length;
+    return LIBMK_SUCCESS;
+}
+
+
+void libmk_free_clip(LibMK_Clip* clip) {
+    if (clip->mapping != NULL)
+        munmap(clip->mapping, clip->mapped);
+    free(clip);
+}
+
+
+LibMK_Result libmk_play_clip(
+        LibMK_Controller* c, const LibMK_Clip* clip, unsigned long start) {
+    unsigned char colors[LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3];
+    const unsigned char* position = clip->frames;
+    unsigned long due = start;
+    for (unsigned int f = 0; f < clip->num_frames; f++) {
+        const LibMK_ClipFrame* frame = (const LibMK_ClipFrame*) position;
+        position += sizeof(LibMK_ClipFrame);
+        if (frame->keyframe) {
+            memcpy(colors, position, LIBMKC_CLIP_KEYFRAME_SIZE);
+            position += LIBMKC_CLIP_KEYFRAME_SIZE;
+        } else {
+            const LibMK_ClipDelta* deltas = (const LibMK_ClipDelta*) position;
+            for (unsigned short d = 0; d < frame->num; d++)
+                memcpy(colors + deltas[d].key * 3, deltas[d].color, 3);
+            position += frame->num * sizeof(LibMK_ClipDelta);
+        }
+        unsigned long next = due + frame->duration;
+        // Late frames are still decoded, as later deltas build on them
+        if (f + 1 < clip->num_frames && libmk_time_us() >= next) {
+            libmk_record_drop(c, 1);
+            due = next;
+            continue;
+        }
+        libmk_sleep_controller(c, due, false);
+        if (libmk_controller_exiting(c, false))
+            return LIBMK_SUCCESS;
+        libmk_record_execution(c, due);
+        int r = libmk_set_all_led_color(c->handle, colors);
+        if (r != LIBMK_SUCCESS)
+            return (LibMK_Result) r;
+        due = next;
+    }
+    return LIBMK_SUCCESS;
+}
+
+
+LibMK_ClipEncoder* libmk_begin_clip(const char* path, unsigned int interval) {
+    LibMK_ClipEncoder* encoder = (LibMK_ClipEncoder*) malloc(
+        sizeof(LibMK_ClipEncoder));
+    if (encoder == NULL)
+        return NULL;
+    encoder->file = fopen(path, "wb");
+    if (encoder->file == NULL) {
+        free(encoder);
+        return NULL;
+    }
+    // The number of frames is filled in by libmk_end_clip
+    LibMK_ClipHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LIBMKC_CLIP_MAGIC, 4);
+    header.version = LIBMKC_CLIP_VERSION;
+    if (fwrite(&header, sizeof(header), 1, encoder->file) != 1) {
+        fclose(encoder->file);
+        free(encoder);
+        return NULL;
+    }
+    memset(encoder->colors, 0, sizeof(encoder->colors));
+    encoder->num_frames = 0;
+    encoder->interval = interval;
+    encoder->since_keyframe = 0;
+    return encoder;
+}
+
+
+LibMK_Result libmk_add_clip_frame(
+        LibMK_ClipEncoder* encoder,
+        unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3],
+        unsigned int duration) {
+    LibMK_ClipDelta deltas[LIBMK_MAX_ROWS * LIBMK_MAX_COLS];
+    unsigned short num = 0;
+    for (unsigned char r = 0; r < LIBMK_MAX_ROWS; r++)
+        for (unsigned char c = 0; c < LIBMK_MAX_COLS; c++) {
+            if (memcmp(colors[r][c], encoder->colors[r][c], 3) == 0)
+                continue;
+            deltas[num].key = (unsigned char) (r * LIBMK_MAX_COLS + c);
+            memcpy(deltas[num].color, colors[r][c], 3);
+            num++;
+        }
+    LibMK_ClipFrame frame;
+    frame.duration = duration;
+    frame.reserved = 0;
+    frame.keyframe = encoder->num_frames == 0 ||
+        (encoder->interval != 0 && encoder->since_keyframe + 1 >= encoder->interval) ||
+        num * sizeof(LibMK_ClipDelta) >= LIBMKC_CLIP_KEYFRAME_SIZE;
+    frame.num = frame.keyframe ? 0 : num;
+
+    bool written = fwrite(&frame, sizeof(frame), 1, encoder->file) == 1;
+    if (frame.keyframe)
+        written = written && fwrite(
+            colors, LIBMKC_CLIP_KEYFRAME_SIZE, 1, encoder->file) == 1;
+    else if (num > 0)
+        written = written && fwrite(
+            deltas, sizeof(LibMK_ClipDelta), num, encoder->file) == num;
+    if (!written)
+        return LIBMK_ERR_FILE;
+    memcpy(encoder->colors, colors, LIBMKC_CLIP_KEYFRAME_SIZE);
+    encoder->since_keyframe = frame.keyframe ? 0 : encoder->since_keyframe + 1;
+    encoder->num_frames++;
+    return LIBMK_SUCCESS;
+}
+
+
+LibMK_Result libmk_end_clip(LibMK_ClipEncoder* encoder) {
+    LibMK_Result r = LIBMK_SUCCESS;
+    if (fseek(encoder->file, offsetof(LibMK_ClipHeader, num_frames), SEEK_SET) != 0 ||
+            fwrite(&encoder->num_frames, sizeof(unsigned int), 1, encoder->file) != 1)
+        r = LIBMK_ERR_FILE;
+    if (fclose(encoder->file) != 0)
+        r = LIBMK_ERR_FILE;
+    free(encoder);
+    return r;
+}
+
+
+LibMK_Result libmk_play_effect(
+        LibMK_Controller* c, const LibMK_Generator* g,
+        unsigned long start, unsigned int duration) {
+    unsigned long interval = g->interval != 0 ? g->interval : LIBMKC_EFFECT_INTERVAL;
+    unsigned long end = start + duration;
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3];
+    memset(colors, 0, sizeof(colors));
+    const LibMK_KeyMap* map = c->handle->keymap;
+    if (!g->uniform && map == NULL)
+        return LIBMK_ERR_UNKNOWN_LAYOUT;
+    // Without a duration, the effect gives way to the next instruction
+    bool preempt = duration == 0;
+    for (unsigned long due = start; preempt || due < end; due += interval) {
+        // Frames that are already late are skipped without evaluating them
+        unsigned long now = libmk_time_us();
+        if (now >= due + interval) {
+            unsigned long late = (now - due) / interval;
+            libmk_record_drop(c, late);
+            due += late * interval;
+            if (!preempt && due >= end)
+                break;
+        }
+        libmk_sleep_controller(c, due, preempt);
+        if (libmk_controller_exiting(c, false) ||
+                (preempt && libmk_controller_preempted(c)))
             break;
+
+        libmk_record_execution(c, due);
+        unsigned long t = due - start;
+        int r;
+        if (g->uniform) {
+            unsigned char color[3];
+            g->kernel(g, t, 0, 0, color);
+            r = libmk_set_full_color(c->handle, color[0], color[1], color[2]);
+        } else {
+            for (int k = 0; k < map->num; k++) {
+                const LibMK_Key* key = &map->keys[k];
+                g->kernel(g, t, key->row, key->col, colors[key->row][key->col]);
+            }
+            r = libmk_set_all_led_color(c->handle, (unsigned char*) colors);
         }
-        prev = curr;
-        curr = curr->next;
+        if (r != LIBMK_SUCCESS)
+            return (LibMK_Result) r;
     }
-    pthread_mutex_unlock(&(c->instr_lock));
     return LIBMK_SUCCESS;
 }
@@ -9,6 +9,15 @@
 #include <time.h>
 #include <unistd.h>
 
+#define LIBMKC_QUEUE_SIZE 4096 // Capacity of the instruction queue, power of two
+#define LIBMKC_CANCEL_MAX 64 // Maximum number of pending cancellations
+#define LIBMKC_SLAB_SIZE 64 // Number of blocks allocated at once by a pool
+#define LIBMKC_RETIRE_BATCH 64 // Executed instructions freed at once
+#define LIBMKC_CLIP_MAGIC "LMKA" // Start of a clip file
+#define LIBMKC_CLIP_VERSION 1 // Format version of clip files
+#define LIBMKC_CLIP_KEYFRAME_SIZE (LIBMK_MAX_ROWS * LIBMK_MAX_COLS * 3)
+#define LIBMKC_EFFECT_INTERVAL 16667 // Default time between effect frames
+
 
 /// @brief Controller States
 typedef enum LibMK_Controller_State {
@@ -25,40 +34,200 @@ typedef enum LibMK_Instruction_Type {
     LIBMK_INSTR_FULL = 0, ///< Full keyboard color instruction
     LIBMK_INSTR_ALL = 1, ///< All LEDs individually instruction
     LIBMK_INSTR_SINGLE = 2, ///< Instruction for a single key
+    LIBMK_INSTR_CLIP = 3, ///< Play all frames of a clip
+    LIBMK_INSTR_EFFECT = 4, ///< Evaluate an effect generator every tick
 } LibMK_Instruction_Type;
 
+struct LibMK_Generator;
+
+/** @brief Kernel of an effect generator
+ *
+ * @param g: Generator with the parameters of the effect
+ * @param t: Time since the start of the effect in microseconds
+ * @param row: Row of the key, 0 for uniform generators
+ * @param col: Column of the key, 0 for uniform generators
+ * @param color: RGB triplet to store the color of the key in
+ */
+typedef void (*LibMK_Kernel)(
+    const struct LibMK_Generator* g, unsigned long t,
+    unsigned char row, unsigned char col, unsigned char* color);
+
+/** @brief Effect that is evaluated by a Controller at every tick
+ *
+ * The kernel is evaluated for every key present on the keyboard when a
+ * frame is due, so only frames that are shown cost time. Uniform
+ * generators are evaluated once per frame and set the full keyboard.
+ */
+typedef struct LibMK_Generator {
+    LibMK_Kernel kernel; ///< Computes the color of a key
+    bool uniform; ///< Whether all keys have the same color
+    unsigned char from[3]; ///< First color of the effect
+    unsigned char to[3]; ///< Second color of the effect
+    unsigned int period; ///< Duration of one cycle in microseconds
+    unsigned int width; ///< Number of columns of one spatial cycle
+    unsigned int interval; ///< Time between frames in microseconds, 0
+                           ///< for LIBMKC_EFFECT_INTERVAL
+} LibMK_Generator;
+
+/** @brief Internal struct. Header of a clip
+ *
+ * Followed by num_frames frames, each a LibMK_ClipFrame followed by
+ * either LIBMKC_CLIP_KEYFRAME_SIZE bytes with the colors of all keys
+ * or num LibMK_ClipDelta entries with the keys that changed.
+ */
+typedef struct LibMK_ClipHeader {
+    char magic[4]; ///< LIBMKC_CLIP_MAGIC
+    unsigned int version; ///< LIBMKC_CLIP_VERSION
+    unsigned int num_frames; ///< Number of frames in the clip
+    unsigned int reserved; ///< Must be zero
+} LibMK_ClipHeader;
+
+/// @brief Internal struct. Frame of a clip
+typedef struct LibMK_ClipFrame {
+    unsigned int duration; ///< Time until the next frame in microseconds
+    unsigned char keyframe; ///< Whether the colors of all keys follow
+    unsigned char reserved; ///< Must be zero
+    unsigned short num; ///< Number of LibMK_ClipDelta following
+} LibMK_ClipFrame;
+
+/// @brief Internal struct. Key that changed color in a frame of a clip
+typedef struct LibMK_ClipDelta {
+    unsigned char key; ///< row * LIBMK_MAX_COLS + column of the key
+    unsigned char color[3]; ///< New color of the key
+} LibMK_ClipDelta;
+
+/** @brief Animation of frames for all keys, played by a Controller
+ *
+ * The frames are read straight from the memory the clip was opened
+ * from, which is mapped from a file by libmk_load_clip.
+ */
+typedef struct LibMK_Clip {
+    const unsigned char* frames; ///< First LibMK_ClipFrame
+    size_t length; ///< Length of the frames in bytes
+    unsigned int num_frames; ///< Number of frames
+    unsigned long duration; ///< Sum of the frame durations
+    void* mapping; ///< Mapped clip file to unmap, if any
+    size_t mapped; ///< Length of the mapping
+} LibMK_Clip;
+
+/** @brief Writer of a clip file, created by libmk_begin_clip
+ *
+ * Writes a keyframe at least every interval frames, and whenever
+ * fewer bytes are needed for a keyframe than for the keys that changed.
+ */
+typedef struct LibMK_ClipEncoder {
+    FILE* file; ///< Clip file being written
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]; ///< Last
+                                                             ///< frame
+    unsigned int num_frames; ///< Number of frames written
+    unsigned int interval; ///< Maximum number of frames per keyframe
+    unsigned int since_keyframe; ///< Frames written since the last
+                                 ///< keyframe
+} LibMK_ClipEncoder;
+
 /** @brief Single instruction that can be executed by a controller
  *
  * An instruction should not be executed multiple times. An instruction
  * is bound to a specific controller as its id attribute is bound to the
  * linked list of instructions of a controller.
+ *
+ * Instructions and their color matrices are allocated from pools, so
+ * they must be freed with libmk_free_instruction or
+ * libmk_free_instructions.
  */
 typedef struct LibMK_Instruction {
-    unsigned char r, c; ///< LIBMK_INSTR_SINGLE, row and column coords
-    unsigned char* colors; ///< LIBMK_INSTR_ALL, key color matrix
-    unsigned char color[3]; ///< LIBMK_INSTR_SINGLE, LIBMK_INSTR_FULL
+    struct LibMK_Instruction* next; ///< Linked list attribute
+    unsigned long deadline; ///< Time to execute at in microseconds from
+                            ///< the start of its stream, set by the
+                            ///< scheduler
     unsigned int duration; ///< Delay after execution of instruction
     unsigned int id; ///< ID number set by the scheduler
-    struct LibMK_Instruction* next; ///< Linked list attribute
-    LibMK_Instruction_Type type; ///< For the instruction execution
+    unsigned char type; ///< LibMK_Instruction_Type, selects the data
+    union {
+        unsigned char color[3]; ///< LIBMK_INSTR_FULL
+        struct {
+            unsigned char r, c; ///< Row and column coords
+            unsigned char color[3]; ///< Color of the key
+        } single; ///< LIBMK_INSTR_SINGLE
+        unsigned char* colors; ///< LIBMK_INSTR_ALL, key color matrix
+        const LibMK_Clip* clip; ///< LIBMK_INSTR_CLIP, clip to play
+        LibMK_Generator* effect; ///< LIBMK_INSTR_EFFECT, generator
+    } data; ///< Arguments of the instruction
 } LibMK_Instruction;
 
+/** @brief Internal struct. Pool of equally sized blocks
+ *
+ * Blocks are allocated in slabs of LIBMKC_SLAB_SIZE and recycled
+ * through a free list, which links the blocks through their first
+ * bytes. Slabs are only freed by libmk_clear_instruction_pools.
+ */
+typedef struct LibMK_Pool {
+    pthread_mutex_t lock; ///< Protects the free list and slabs
+    void* free; ///< First free block
+    void* slabs; ///< Linked list of the slabs allocated
+    size_t size; ///< Size of a block
+} LibMK_Pool;
+
+/** @brief Timing counters of a Controller
+ *
+ * Retrieved with libmk_get_controller_stats. The jitter histogram is
+ * bucketed like the latency histograms of LibMK_Stats.
+ */
+typedef struct LibMK_Controller_Stats {
+    unsigned long executed; ///< Number of instructions executed
+    unsigned long dropped; ///< Number of frames dropped for being late
+    unsigned long streams; ///< Number of streams started
+    unsigned long jitter[LIBMK_LATENCY_BUCKETS]; ///< Time from the
+                                  ///< deadline of an instruction to its
+                                  ///< execution
+    unsigned long max_jitter; ///< Largest time from a deadline to the
+                              ///< execution in microseconds
+} LibMK_Controller_Stats;
+
 /** @brief Controller for a keyboard managing a single handle
  *
  * Access to the various attributes of the Controller is
  * protected by mutexes and the attributes of the controller should
  * therefore not be accessed directly.
+ *
+ * Scheduled instructions are kept in a ring with a single consumer, the
+ * controller thread, which never takes the locks of the schedulers. The
+ * head and tail are free-running counters that are only accessed
+ * atomically outside of the thread that writes them.
+ *
+ * Instructions scheduled while the queue is empty start a new stream.
+ * Each instruction is executed at an absolute time: the start of its
+ * stream plus its deadline, so time spent on execution does not add up
+ * over a stream.
  */
 typedef struct LibMK_Controller {
     LibMK_Handle* handle; ///< Handle of the keyboard to control
-    LibMK_Instruction* instr; ///< Linked list of instructions
-    pthread_mutex_t instr_lock; ///< Protects LibMK_Instruction* instr
+    LibMK_Instruction* queue[LIBMKC_QUEUE_SIZE]; ///< Ring of instructions
+    unsigned int head; ///< Next instruction, written by the controller
+    unsigned int tail; ///< End of the ring, written with sched_lock
+    pthread_mutex_t sched_lock; ///< Serializes schedulers, protects tail
+                                ///< and last_id
+    unsigned int last_id; ///< ID of the last instruction scheduled
+    unsigned long stream_end; ///< End of the last instruction scheduled
+                              ///< relative to the start of its stream
+    unsigned int done_id; ///< ID of the last instruction taken off the ring
+    pthread_mutex_t cancel_lock; ///< Protects cancelled
+    unsigned int cancelled[LIBMKC_CANCEL_MAX]; ///< IDs of instructions
+                                               ///< still to cancel
+    unsigned int num_cancelled; ///< Number of IDs in cancelled
+    pthread_mutex_t instr_lock; ///< Protects waiting on instr_cond
+    pthread_cond_t instr_cond; ///< Signalled with instr_lock when
+                               ///< instructions are scheduled or an
+                               ///< exit is requested
     pthread_t thread; ///< Thread for libmk_run_controller
     pthread_mutex_t exit_flag_lock; ///< Protects bool exit_flag and wait_flag
     bool exit_flag; ///< Exit event: Thread exits immediately
     bool wait_flag; ///< Wait event: Thread exits when all instructions are done
     pthread_mutex_t state_lock; ///< Protects LibMK_Controller_State state
+    pthread_cond_t state_cond; ///< Signalled with state_lock on stopping
     LibMK_Controller_State state; ///< Stores current state of controller
+    pthread_mutex_t stats_lock; ///< Protects LibMK_Controller_Stats stats
+    LibMK_Controller_Stats stats; ///< Timing counters
     pthread_mutex_t error_lock; ///< Protects LibMK_Result error
     LibMK_Result error; ///< Set for LIBMK_STATE_ERROR
 } LibMK_Controller;
@@ -82,7 +251,7 @@ LibMK_Result libmk_free_controller(LibMK_Controller* c);
 /** @brief Schedule a linked-list of instructions
  *
  * Instruction scheduler than schedules the given linked-list of
- * instructions at the end of the list of the controller in the given
+ * instructions at the end of the queue of the controller in the given
  * order. After scheduling, all instructions are given an ID number
  * and they may not be scheduled again. After execution, the
  * instructions are freed and thus after scheduling an instruction may
@@ -91,7 +260,12 @@ LibMK_Result libmk_free_controller(LibMK_Controller* c);
  * Returns the instruction ID of the first instruction in the linked
  * list (it is the user's responsibility to derive the ID number of the
  * other instructions) upon success (postive integer) or a LibMK_Result
- * (negative integer) upon failure.
+ * (negative integer) upon failure. If the whole linked list does not
+ * fit in the queue, none of it is scheduled and LIBMK_ERR_QUEUE_FULL
+ * is returned. A linked list of more than LIBMKC_QUEUE_SIZE
+ * instructions can never be scheduled at once and is rejected with
+ * LIBMK_ERR_INVALID_ARG. Such a list must be split and scheduled in
+ * parts as the queue empties.
  */
 int libmk_sched_instruction(
     LibMK_Controller* controller, LibMK_Instruction* instruction);
@@ -101,10 +275,27 @@ int libmk_sched_instruction(
  * If the instruction has already been executed, the instruction is not
  * cancelled and the function fails quietly. Does not cancel any
  * successive instructions even if the instruction was scheduled as
- * part of a linked-list.
+ * part of a linked-list. The instruction is skipped and freed by the
+ * Controller when it reaches it. Returns LIBMK_ERR_QUEUE_FULL if
+ * LIBMKC_CANCEL_MAX cancellations are already pending.
  */
 LibMK_Result libmk_cancel_instruction(LibMK_Controller* c, unsigned int id);
 
+/** @brief Internal Function. Take an ID from the pending cancellations
+ *
+ * Called by the Controller for every instruction it takes off the ring.
+ * Also drops the cancellations of instructions it has passed.
+ *
+ * @returns Whether the instruction with the ID was cancelled
+ */
+bool libmk_take_cancelled(LibMK_Controller* c, unsigned int id);
+
+/** @brief Retrieve the number of instructions waiting in the queue
+ *
+ * Does not include the instruction that is being executed.
+ */
+unsigned int libmk_get_queue_depth(LibMK_Controller* c);
+
 /** @brief Start a new Controller thread
  *
  * Start the execution of instructions upon the keyboard in a different
@@ -113,22 +304,53 @@ LibMK_Result libmk_cancel_instruction(LibMK_Controller* c, unsigned int id);
  */
 LibMK_Result libmk_start_controller(LibMK_Controller* controller);
 
-/** @brief Internal Function. Execute Controller instructions. */
+/** @brief Internal Function. Execute Controller instructions.
+ *
+ * Sleeps on instr_cond while there are no instructions and until the
+ * deadline of each instruction, so an idle Controller does not wake up
+ * until an instruction is scheduled or an exit is requested. A frame
+ * that is only due after the next frame is already due is dropped.
+ */
 void libmk_run_controller(LibMK_Controller* controller);
 
+/** @brief Internal Function. Whether an open-ended instruction ends
+ *
+ * True if instructions wait in the queue, or if the Controller was
+ * asked to exit or to finish the pending instructions. Only to be
+ * called by the Controller thread.
+ */
+bool libmk_controller_preempted(LibMK_Controller* c);
+
+/** @brief Internal Function. Sleep until a time or an exit request
+ *
+ * @param until: Monotonic time as returned by libmk_time_us
+ * @param preempt: Whether to wake up when an instruction is scheduled
+ *    or the Controller is asked to finish
+ */
+void libmk_sleep_controller(
+    LibMK_Controller* c, unsigned long until, bool preempt);
+
+/** @brief Retrieve the timing counters of a Controller
+ *
+ * @param stats: Pointer to LibMK_Controller_Stats to copy the counters to
+ */
+LibMK_Result libmk_get_controller_stats(
+    LibMK_Controller* c, LibMK_Controller_Stats* stats);
+
 /** @brief Request an exit on a running controller
  *
- * The request is passed using the exit_flag, and thus the Controller
- * may not immediately be stopped. To assure that the controller has
- * stopped, use libmk_join_controller.
+ * The request is passed using the exit_flag and wakes the Controller,
+ * which exits without finishing the duration of the instruction it is
+ * executing. To assure that the controller has stopped, use
+ * libmk_join_controller.
  */
 void libmk_stop_controller(LibMK_Controller* controller);
 
 /** @brief Indicate the controller to finish only pending instructions
  *
  * If instructions are scheduled in the mean-time, they are added to the
- * linked list and still executed by the Controller before exiting. Only
- * after the linked list has become empty does the Controller exit.
+ * queue and still executed by the Controller before exiting. Only
+ * after the queue has become empty does the Controller exit.
  *
  * This function sets the wait_flag, and thus the Controller has not
  * necessarily stopped after this function ends. To assure that the
@@ -147,6 +369,12 @@ LibMK_Controller_State libmk_join_controller(LibMK_Controller* c, double t);
 /** @brief Internal Function. */
 void libmk_set_controller_error(LibMK_Controller* c, LibMK_Result r);
 
+/** @brief Internal Function. Read the exit flags, with instr_lock held
+ *
+ * @returns Whether the Controller should exit
+ */
+bool libmk_controller_exiting(LibMK_Controller* c, bool idle);
+
 /** @brief Allocate a new LibMK_Instruction struct */
 LibMK_Instruction* libmk_create_instruction();
 
@@ -167,22 +395,127 @@ LibMK_Instruction* libmk_create_instruction_full(unsigned char c[3]);
 LibMK_Instruction* libmk_create_instruction_all(
     unsigned char c[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3]);
 
-/** @brief Create a new list of instructions to flash the keyboard
+/** @brief Create a new instruction to flash the keyboard
  *
- * Makes use of LIBMK_INSTR_FULL type instructions. Builds a linked list
- * of n instructions.
+ * Makes use of a libmk_kernel_flash generator that fades in to the
+ * color in n steps and then fades out in n steps.
  *
  * @param c: RGB color triplet that is copied to the instruction.
- * @param delay: Duration set for each individual instruction of the
- *    linked list in microseconds, excluding the time required for
- *    instruction execution itself.
- * @param n: Number of instructions in the linked list to be built.
+ * @param delay: Duration of each step in microseconds.
+ * @param n: Number of steps of each fade.
  *
- * @returns Pointer to linked list of LibMK_Instruction.
+ * @returns Single LibMK_Instruction lasting 2n steps. If n or delay
+ *    is 0, a single black frame is shown instead.
  */
 LibMK_Instruction* libmk_create_instruction_flash(
     unsigned char c[3], unsigned int delay, unsigned char n);
 
+/** @brief Create a new instruction to evaluate an effect generator
+ *
+ * @param g: Generator that is copied to the instruction
+ * @param duration: Duration of the effect in microseconds. If 0, the
+ *    effect lasts until another instruction is scheduled, or until
+ *    the Controller is stopped or has to finish with libmk_wait_controller.
+ * @returns Single LibMK_Instruction.
+ */
+LibMK_Instruction* libmk_create_instruction_effect(
+    const LibMK_Generator* g, unsigned int duration);
+
+/** @brief Create a new instruction to fade from one color to another
+ *
+ * @param from: RGB color at the start of the fade
+ * @param to: RGB color at the end of the fade, kept afterwards
+ * @param period: Duration of the fade in microseconds
+ * @param duration: Duration of the instruction, 0 for no limit
+ */
+LibMK_Instruction* libmk_create_instruction_fade(
+    unsigned char from[3], unsigned char to[3],
+    unsigned int period, unsigned int duration);
+
+/** @brief Create a new instruction to let the keyboard breathe a color
+ *
+ * @param c: RGB color at the peak of a breath
+ * @param period: Duration of a breath in microseconds
+ * @param duration: Duration of the instruction, 0 for no limit
+ */
+LibMK_Instruction* libmk_create_instruction_breathe(
+    unsigned char c[3], unsigned int period, unsigned int duration);
+
+/** @brief Create a new instruction for a rainbow moving over the keys
+ *
+ * @param period: Time for a key to pass through all hues in microseconds
+ * @param width: Number of columns the rainbow is spread over
+ * @param duration: Duration of the instruction, 0 for no limit
+ */
+LibMK_Instruction* libmk_create_instruction_wave(
+    unsigned int period, unsigned int width, unsigned int duration);
+
+/** @brief Create a new instruction for a gradient moving over the keys
+ *
+ * @param from: RGB color at one end of the gradient
+ * @param to: RGB color at the other end of the gradient
+ * @param period: Time for the gradient to move width columns
+ * @param width: Number of columns from one end of the gradient back to
+ *    the same end
+ * @param duration: Duration of the instruction, 0 for no limit
+ */
+LibMK_Instruction* libmk_create_instruction_sweep(
+    unsigned char from[3], unsigned char to[3],
+    unsigned int period, unsigned int width, unsigned int duration);
+
+/** @brief Kernel fading in to from and back out over a period */
+void libmk_kernel_flash(
+    const LibMK_Generator* g, unsigned long t,
+    unsigned char row, unsigned char col, unsigned char* color);
+
+/** @brief Kernel fading from from to to over a period */
+void libmk_kernel_fade(
+    const LibMK_Generator* g, unsigned long t,
+    unsigned char row, unsigned char col, unsigned char* color);
+
+/** @brief Kernel smoothly fading from in and out every period */
+void libmk_kernel_breathe(
+    const LibMK_Generator* g, unsigned long t,
+    unsigned char row, unsigned char col, unsigned char* color);
+
+/** @brief Kernel for a rainbow of width columns moving every period */
+void libmk_kernel_wave(
+    const LibMK_Generator* g, unsigned long t,
+    unsigned char row, unsigned char col, unsigned char* color);
+
+/** @brief Kernel for a gradient of width columns moving every period */
+void libmk_kernel_sweep(
+    const LibMK_Generator* g, unsigned long t,
+    unsigned char row, unsigned char col, unsigned char* color);
+
+/** @brief Internal Function. Position of a time within a period
+ *
+ * @returns Position from 0 to 255, 255 if the period is 0
+ */
+unsigned int libmk_phase(unsigned long t, unsigned int period);
+
+/** @brief Internal Function. Position of a column within a cycle
+ *
+ * @param width: Number of columns of a cycle, 0 for LIBMK_MAX_COLS
+ * @returns Position from 0 to 255
+ */
+unsigned int libmk_column_phase(unsigned char col, unsigned int width);
+
+/** @brief Internal Function. Triangle wave of a position
+ *
+ * @returns Value rising from 0 to 254 over the first half of the
+ *    positions and falling back over the second half
+ */
+unsigned int libmk_triangle(unsigned int phase);
+
+/** @brief Internal Function. Mix two colors
+ *
+ * @param weight: Weight of the second color, from 0 to 255
+ */
+void libmk_mix_colors(
+    const unsigned char* a, const unsigned char* b, unsigned int weight,
+    unsigned char* color);
+
 
 /** @brief Create a new instruction to set the color of a single key
  *
@@ -199,6 +532,89 @@ LibMK_Instruction* libmk_create_instruction_flash(
 LibMK_Instruction* libmk_create_instruction_single(
     unsigned char row, unsigned char column, unsigned char c[3]);
 
+/** @brief Create a new instruction to play a clip
+ *
+ * The frames of the clip are executed at their own deadlines and late
+ * frames are dropped, as for instructions. The clip is not copied and
+ * must not be freed before the instruction has been executed.
+ *
+ * @param clip: Clip opened with libmk_open_clip or libmk_load_clip
+ * @returns Single LibMK_Instruction with the duration of the clip.
+ */
+LibMK_Instruction* libmk_create_instruction_clip(const LibMK_Clip* clip);
+
+/** @brief Open a clip from memory
+ *
+ * @param data: Contents of a clip file, which must remain valid and
+ *    unchanged until the clip is freed
+ * @param length: Length of data in bytes
+ * @param clip: Pointer to store the new clip in
+ * @returns LibMK_Result result code, LIBMK_ERR_FILE if the data is not
+ *    a valid clip
+ */
+LibMK_Result libmk_open_clip(
+    const unsigned char* data, size_t length, LibMK_Clip** clip);
+
+/** @brief Open a clip by mapping a clip file into memory
+ *
+ * @param path: Path of a file written with libmk_begin_clip
+ * @param clip: Pointer to store the new clip in
+ * @returns LibMK_Result result code
+ */
+LibMK_Result libmk_load_clip(const char* path, LibMK_Clip** clip);
+
+/** @brief Free a clip and unmap its file */
+void libmk_free_clip(LibMK_Clip* clip);
+
+/** @brief Start writing a clip file
+ *
+ * @param path: Path of the file to write
+ * @param interval: Maximum number of frames from one keyframe to the
+ *    next, 0 for no maximum
+ * @returns Encoder to add the frames with, NULL if the file could not
+ *    be opened
+ */
+LibMK_ClipEncoder* libmk_begin_clip(const char* path, unsigned int interval);
+
+/** @brief Add a frame to a clip file
+ *
+ * @param colors: Colors of all keys in the frame
+ * @param duration: Time until the next frame in microseconds
+ */
+LibMK_Result libmk_add_clip_frame(
+    LibMK_ClipEncoder* encoder,
+    unsigned char colors[LIBMK_MAX_ROWS][LIBMK_MAX_COLS][3],
+    unsigned int duration);
+
+/** @brief Finish a clip file and free the encoder */
+LibMK_Result libmk_end_clip(LibMK_ClipEncoder* encoder);
+
+/** @brief Internal Function. Play the frames of a clip
+ *
+ * @param start: Monotonic time at which the first frame is due
+ */
+LibMK_Result libmk_play_clip(
+    LibMK_Controller* c, const LibMK_Clip* clip, unsigned long start);
+
+/** @brief Internal Function. Evaluate an effect generator every tick
+ *
+ * @param start: Monotonic time at which the first frame is due
+ * @param duration: Duration of the effect, 0 to evaluate the effect
+ *    until another instruction is scheduled or the Controller finishes
+ */
+LibMK_Result libmk_play_effect(
+    LibMK_Controller* c, const LibMK_Generator* g,
+    unsigned long start, unsigned int duration);
+
+/** @brief Internal Function. Count an execution in the statistics
+ *
+ * @param due: Monotonic time at which the execution was due
+ */
+void libmk_record_execution(LibMK_Controller* c, unsigned long due);
+
+/** @brief Internal Function. Count dropped frames in the statistics */
+void libmk_record_drop(LibMK_Controller* c, unsigned long n);
+
 /** @brief Free a single LibMK_Instruction
  *
  * The instruction is expected to longer be part of a linked list. This
@@ -209,5 +625,35 @@ LibMK_Instruction* libmk_create_instruction_single(
  */
 void libmk_free_instruction(LibMK_Instruction* i);
 
+/** @brief Free a whole linked list of instructions at once
+ *
+ * Returns all instructions and color matrices of the list to their
+ * pools, taking the lock of each pool only once.
+ */
+void libmk_free_instructions(LibMK_Instruction* i);
+
+/** @brief Release the memory of the instruction pools
+ *
+ * No instruction may exist anymore when this function is called, so
+ * it is called after the last controller was freed, for example just
+ * before libmk_exit. The pools allocate memory again when instructions
+ * are created afterwards.
+ */
+void libmk_clear_instruction_pools(void);
+
+/** @brief Internal Function. Take a block from a pool
+ *
+ * @returns Pointer to the block, NULL if a slab could not be allocated
+ */
+void* libmk_pool_alloc(LibMK_Pool* pool);
+
+/** @brief Internal Function. Return blocks to a pool
+ *
+ * @param first: First block of a list linked through the first bytes
+ *    of each block
+ * @param last: Last block of the list
+ */
+void libmk_pool_release(LibMK_Pool* pool, void* first, void* last);
+
 /** @brief Internal Function. Execute a single instruction. NOT THREAD-SAFE. */
 LibMK_Result libmk_exec_instruction(LibMK_Handle* h, LibMK_Instruction* i);
@@ -47,6 +47,13 @@ class ResultCode:
     # Protocol Errors
     ERR_PROTOCOL = -13
 
+    # Library Errors
+    ERR_THREAD = -17
+    ERR_NOT_RUNNING = -18
+    ERR_UNSUPPORTED = -19
+    ERR_FILE = -20
+    ERR_NO_MEMORY = -22
+
 
 class Effect:
     EFF_FULL_ON = 0
@@ -78,6 +85,12 @@ class Model:
     MODEL_UNKNOWN = -3
 
 
+class Layout:
+    LAYOUT_UNKNOWN = 0
+    LAYOUT_ANSI = 1
+    LAYOUT_ISO = 2
+
+
 class ControlMode:
     FIRMWARE_CTRL = 0x00
     EFFECT_CTRL = 0x01
@@ -126,6 +139,71 @@ def set_device(model):
     return _mk.set_device(model)
 
 
+def set_simulated_device(model, layout=Layout.LAYOUT_ANSI):
+    # type: (int, int) -> int
+    """
+    Set the device to be controlled by the library to a simulated device
+
+    The simulated device behaves as a keyboard of the specified model
+    would, but does not require a keyboard to be connected.
+
+    :param model: Model to simulate (:class:`.Model`)
+    :type model: int
+    :param layout: Layout to simulate (:class:`.Layout`)
+    :type layout: int
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.set_simulated_device(model, layout)
+
+
+def set_simulated_latency(latency):
+    # type: (int) -> int
+    """
+    Set the duration of every transfer to the simulated device
+
+    :param latency: Duration of a transfer in microseconds
+    :type latency: int
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.set_simulated_latency(latency)
+
+
+def set_cache_file(path):
+    # type: (str) -> int
+    """
+    Set the file to cache the details of the devices in
+
+    With a cache file, the keyboards are detected and control is
+    enabled without waiting for the descriptors and firmware version
+    of the keyboards.
+
+    :param path: Path of the cache file, or None to disable the cache
+    :type path: str
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.set_cache_file(path)
+
+
+def load_layouts(path):
+    # type: (str) -> int
+    """
+    Load layout maps from a binary layouts file
+
+    The layouts file is written by the record utility and adds support
+    for layouts that are not built into the library. Maps in the file
+    take precedence over the built-in maps.
+
+    :param path: Path of the layouts file
+    :type path: str
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.load_layouts(path)
+
+
 def enable_control():
     # type: () -> int
     """
@@ -148,6 +226,21 @@ def disable_control():
     return _mk.disable_control()
 
 
+def handoff_control():
+    # type: () -> int
+    """
+    Hand control of the device back without resetting it
+
+    Unlike :func:`disable_control`, the keyboard is not reset, so key
+    input is not interrupted and control may be enabled again right
+    away.
+
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.handoff_control()
+
+
 def set_effect(effect):
     # type: (int) -> int
     """
@@ -341,3 +434,53 @@ def set_control_mode(mode):
     """
     return _mk.set_control_mode(mode)
 
+
+def get_stats():
+    # type: () -> (Dict[str, int or Tuple[int, ...]] or int)
+    """
+    Return the counters of the communication with the keyboard
+
+    The latency histograms are tuples of counters. The first bucket
+    counts latencies below 2 microseconds, bucket i counts latencies
+    from 2^i up to 2^(i+1) microseconds and the last bucket also counts
+    all latencies above it.
+
+    :return: Dictionary with the keys packets_sent, responses, timeouts,
+        protocol_errors, bytes_sent, bytes_received, out_latency,
+        in_latency, frame_latency, recoveries, failed_recoveries and
+        recovery_latency, or a result code
+        (:class:`.ResultCode`) upon failure
+    :rtype: Dict[str, int or Tuple[int, ...]] or int
+    """
+    return _mk.get_stats()
+
+
+def reset_stats():
+    # type: () -> int
+    """
+    Reset the counters of the communication with the keyboard to zero
+
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.reset_stats()
+
+
+def set_recovery(attempts, backoff):
+    # type: (int, int) -> int
+    """
+    Recover from failed transfers by reopening the keyboard
+
+    The keyboard on the same port is reopened and the last control
+    mode, effect and colors are restored. Recovery is disabled by
+    default.
+
+    :param attempts: Maximum number of attempts, 0 to disable
+    :type attempts: int
+    :param backoff: Delay before the first attempt in microseconds,
+        doubled for every following attempt
+    :type backoff: int
+    :return: Result code (:class:`.ResultCode`)
+    :rtype: int
+    """
+    return _mk.set_recovery(attempts, backoff)
@@ -80,6 +80,47 @@ static PyObject* masterkeys_set_device(PyObject* self, PyObject* args) {
 }
 
 
+static PyObject* masterkeys_set_simulated_device(PyObject* self, PyObject* args) {
+    /** Set the device to control to a simulated keyboard
+     *
+     * Allows the use of the library without a keyboard being connected,
+     * for example for benchmarks.
+    */
+    LibMK_Model model;
+    LibMK_Layout layout;
+    if (!PyArg_ParseTuple(args, "ii", &model, &layout))
+        return NULL;
+    return PyInt_FromLong(libmk_set_simulated_device(model, layout, NULL));
+}
+
+
+static PyObject* masterkeys_set_simulated_latency(PyObject* self, PyObject* args) {
+    /** Set the latency of the transfers to the simulated keyboard */
+    unsigned int latency;
+    if (!PyArg_ParseTuple(args, "I", &latency))
+        return NULL;
+    return PyInt_FromLong(libmk_set_simulated_latency(NULL, latency));
+}
+
+
+static PyObject* masterkeys_set_cache_file(PyObject* self, PyObject* args) {
+    /** Set the file to cache the details of the devices in */
+    const char* path;
+    if (!PyArg_ParseTuple(args, "z", &path))
+        return NULL;
+    return PyInt_FromLong(libmk_set_cache_file(path));
+}
+
+
+static PyObject* masterkeys_load_layouts(PyObject* self, PyObject* args) {
+    /** Load layout maps from a binary layouts file */
+    const char* path;
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+    return PyInt_FromLong(libmk_load_layouts(path));
+}
+
+
 static PyObject* masterkeys_enable_control(PyObject* self, PyObject* args) {
     /** Enable control of the set control device */
     int r = libmk_enable_control(NULL);  // NULL -> global DeviceHandle
@@ -94,6 +135,13 @@ static PyObject* masterkeys_disable_control(PyObject* self, PyObject* args) {
 }
 
 
+static PyObject* masterkeys_handoff_control(PyObject* self, PyObject* args) {
+    /** Hand control of the set control device back without a reset */
+    int r = libmk_handoff_control(NULL);  // NULL -> global DeviceHandle
+    return PyInt_FromLong(r);
+}
+
+
 static PyObject* masterkeys_set_effect(PyObject* self, PyObject* args) {
     /** Set the effect of the keyboard to one of the built-ins */
     LibMK_Effect effect;
@@ -270,6 +318,59 @@ static PyObject* masterkeys_set_control_mode(PyObject* self, PyObject* args) {
 }
 
 
+static PyObject* masterkeys_build_histogram(unsigned long* histogram) {
+    /** Build a tuple of the counters of a latency histogram */
+    PyObject* tuple = PyTuple_New(LIBMK_LATENCY_BUCKETS);
+    if (tuple == NULL)
+        return NULL;
+    for (short i = 0; i < LIBMK_LATENCY_BUCKETS; i++)
+        PyTuple_SET_ITEM(tuple, i, PyLong_FromUnsignedLong(histogram[i]));
+    return tuple;
+}
+
+
+static PyObject* masterkeys_get_stats(PyObject* self, PyObject* args) {
+    /** Return a dictionary of the communication counters of the device
+     *
+     * If the counters cannot be retrieved, the result code is returned
+     * instead.
+    */
+    LibMK_Stats stats;
+    int r = libmk_get_stats(NULL, &stats);
+    if (r != LIBMK_SUCCESS)
+        return PyInt_FromLong(r);
+    return Py_BuildValue(
+        "{s:k,s:k,s:k,s:k,s:k,s:k,s:N,s:N,s:N,s:k,s:k,s:N}",
+        "packets_sent", stats.packets_sent,
+        "responses", stats.responses,
+        "timeouts", stats.timeouts,
+        "protocol_errors", stats.protocol_errors,
+        "bytes_sent", stats.bytes_sent,
+        "bytes_received", stats.bytes_received,
+        "out_latency", masterkeys_build_histogram(stats.out_latency),
+        "in_latency", masterkeys_build_histogram(stats.in_latency),
+        "frame_latency", masterkeys_build_histogram(stats.frame_latency),
+        "recoveries", stats.recoveries,
+        "failed_recoveries", stats.failed_recoveries,
+        "recovery_latency", masterkeys_build_histogram(stats.recovery_latency));
+}
+
+
+static PyObject* masterkeys_set_recovery(PyObject* self, PyObject* args) {
+    /** Set the number of attempts to recover from failed transfers */
+    unsigned int attempts, backoff;
+    if (!PyArg_ParseTuple(args, "II", &attempts, &backoff))
+        return NULL;
+    return PyInt_FromLong(libmk_set_recovery(NULL, attempts, backoff));
+}
+
+
+static PyObject* masterkeys_reset_stats(PyObject* self, PyObject* args) {
+    /** Reset the communication counters of the device */
+    return PyInt_FromLong(libmk_reset_stats(NULL));
+}
+
+
 static struct PyMethodDef masterkeys_funcs[] = {
     {
         "detect_devices",
@@ -281,6 +382,26 @@ static struct PyMethodDef masterkeys_funcs[] = {
         masterkeys_set_device,
         METH_VARARGS,
         "Set the device to control with the library"
+    }, {
+        "set_simulated_device",
+        masterkeys_set_simulated_device,
+        METH_VARARGS,
+        "Set the device to control to a simulated keyboard"
+    }, {
+        "set_simulated_latency",
+        masterkeys_set_simulated_latency,
+        METH_VARARGS,
+        "Set the latency of the transfers to the simulated keyboard"
+    }, {
+        "set_cache_file",
+        masterkeys_set_cache_file,
+        METH_VARARGS,
+        "Set the file to cache the details of the devices in"
+    }, {
+        "load_layouts",
+        masterkeys_load_layouts,
+        METH_VARARGS,
+        "Load layout maps from a binary layouts file"
     }, {
         "enable_control",
         masterkeys_enable_control,
@@ -291,6 +412,11 @@ static struct PyMethodDef masterkeys_funcs[] = {
         masterkeys_disable_control,
         METH_NOARGS,
         "Disable control of the RGB LEDs on the controlled device"
+    }, {
+        "handoff_control",
+        masterkeys_handoff_control,
+        METH_NOARGS,
+        "Hand control of the RGB LEDs back without resetting the device"
     }, {
         "set_effect",
         masterkeys_set_effect,
@@ -338,6 +464,21 @@ static struct PyMethodDef masterkeys_funcs[] = {
        masterkeys_save_profile,
        METH_VARARGS,
        "Save the changes made to the active profile"
+    }, {
+        "get_stats",
+        masterkeys_get_stats,
+        METH_NOARGS,
+        "Return the communication counters of the controlled device"
+    }, {
+        "reset_stats",
+        masterkeys_reset_stats,
+        METH_NOARGS,
+        "Reset the communication counters of the controlled device"
+    }, {
+        "set_recovery",
+        masterkeys_set_recovery,
+        METH_VARARGS,
+        "Set the number of attempts to recover from failed transfers"
     }, {
         "set_control_mode",
         masterkeys_set_control_mode,
@@ -78,6 +78,8 @@ int main(void) {
     for (r=0; r < LIBMK_MAX_ROWS; r++)
         for (c=0; c < LIBMK_MAX_COLS; c++)
             layout[r][c] = 0x00;
+    LibMK_Key keys[LIBMK_MAX_ROWS * LIBMK_MAX_COLS];
+    int num = 0;
     libmk_enable_control(handle);
     
     LibMK_Firmware* fw;
@@ -121,7 +123,17 @@ int main(void) {
             continue;
         else if (r == -2 || c == -2)
             break;
+        if (r < 0 || c < 0 || r >= LIBMK_MAX_ROWS || c >= LIBMK_MAX_COLS ||
+                num == LIBMK_MAX_ROWS * LIBMK_MAX_COLS) {
+            printf("Invalid coordinates.\n");
+            continue;
+        }
         layout[r][c] = offset;
+        keys[num].row = (unsigned char) r;
+        keys[num].col = (unsigned char) c;
+        keys[num].offset = offset;
+        keys[num].reserved = 0;
+        num++;
         packet = libmk_build_packet(
             8, 0xC0, 0x01, 0x01, 0x00, 0x00, 0x00, 0xFF, 0x00);
         packet[4] = offset;
@@ -134,6 +146,10 @@ int main(void) {
             return -3;
         }
         write_file(layout, handle->bVendor, handle->bDevice, fw);
+        // The binary map can be loaded directly with libmk_load_layouts
+        libmk_write_layout(
+            "layout.bin", handle->bDevice, handle->layout, handle->size,
+            keys, num);
     }
     libmk_disable_control(handle);
     libmk_free_handle(handle);